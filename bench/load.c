@@ -0,0 +1,377 @@
+// HTTP load generator used for the measurements in
+// bench/README.md. It's a single-threaded client that
+// keeps a number of connections busy for a given time
+// and reports the requests (or connections) per second.
+//
+// Build with:
+//   $ gcc -O2 bench/load.c -o load
+//
+// Usage:
+//   $ ./load [options] [port]
+//
+//   -c <n>     Number of connections (default 50).
+//   -d <secs>  Duration of the run (default 10).
+//   -p <n>     Pipeline depth: each connection sends the
+//              requests <n> times in one write and waits
+//              for all the responses before sending them
+//              again (default 1).
+//   -u <path>  URL of the request (default "/").
+//   -f <file>  Send the requests in <file> instead. They
+//              must have no body. Each batch contains all
+//              of them, <n> times.
+//   -n         Open a new connection for each request
+//              ("Connection: close"), which measures
+//              accepts instead of requests.
+//
+// Connections that are closed by the server in the middle
+// of a batch are reopened and the batch is sent again. Only
+// the responses that were received completely are counted.
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+typedef struct {
+	int    fd;
+	size_t sent;     // Bytes of the batch sent.
+	int    received; // Responses of the batch received.
+
+	char  *data;     // Input that wasn't parsed yet.
+	size_t used;
+	size_t size;
+} client_t;
+
+static char  *batch;
+static size_t batch_len;
+static int    batch_count;
+
+static bool new_conn_per_request = 0;
+static struct sockaddr_in address;
+static int epfd;
+
+static unsigned long long responses;
+static unsigned long long errors;
+static unsigned long long connects;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *load_file(const char *file, size_t *len)
+{
+	FILE *stream = fopen(file, "rb");
+	if(stream == NULL)
+		return NULL;
+
+	char  *data = NULL;
+	size_t size = 0;
+	size_t used = 0;
+	while(1)
+	{
+		if(used == size)
+		{
+			size = size ? 2 * size : 4096;
+			data = realloc(data, size);
+			if(data == NULL)
+				abort();
+		}
+		size_t n = fread(data + used, 1, size - used, stream);
+		if(n == 0)
+			break;
+		used += n;
+	}
+	fclose(stream);
+	*len = used;
+	return data;
+}
+
+static void client_connect(client_t *client)
+{
+	client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(client->fd < 0)
+	{
+		perror("socket");
+		exit(1);
+	}
+
+	int one = 1;
+	(void) setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if(connect(client->fd, (struct sockaddr*) &address, sizeof(address)) && errno != EINPROGRESS)
+	{
+		perror("connect");
+		exit(1);
+	}
+
+	// Edge-triggered, since the socket is always read
+	// and written until it would block.
+	struct epoll_event event;
+	event.events = EPOLLET | EPOLLIN | EPOLLOUT;
+	event.data.ptr = client;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, client->fd, &event))
+	{
+		perror("epoll_ctl");
+		exit(1);
+	}
+
+	client->sent = 0;
+	client->received = 0;
+	client->used = 0;
+	connects += 1;
+}
+
+static void client_reconnect(client_t *client)
+{
+	(void) close(client->fd);
+	client_connect(client);
+}
+
+static void client_send(client_t *client)
+{
+	while(client->sent < batch_len)
+	{
+		ssize_t n = send(client->fd, batch + client->sent, batch_len - client->sent, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == ENOTCONN)
+				return;
+			if(errno != EPIPE && errno != ECONNRESET)
+				errors += 1;
+			client_reconnect(client);
+			return;
+		}
+		client->sent += n;
+	}
+}
+
+/* Symbol: parse_responses
+ *
+ *   Consume the complete responses at the start of
+ *   the client's input. Only bodies delimited by a
+ *   Content-Length header are supported.
+ */
+static void parse_responses(client_t *client)
+{
+	size_t off = 0;
+	while(1)
+	{
+		char *head = client->data + off;
+		size_t avail = client->used - off;
+
+		char *end = memmem(head, avail, "\r\n\r\n", 4);
+		if(end == NULL)
+			break;
+
+		size_t head_len = end - head + 4;
+		size_t body_len = 0;
+
+		char *line = memchr(head, '\n', head_len);
+		while(line != NULL && line < end)
+		{
+			line += 1;
+			if(!strncasecmp(line, "Content-Length:", 15))
+				body_len = strtoul(line + 15, NULL, 10);
+			line = memchr(line, '\n', end + 4 - line);
+		}
+
+		if(avail < head_len + body_len)
+			break;
+
+		if(avail < 12 || head[9] != '2')
+			errors += 1;
+		else
+			responses += 1;
+
+		client->received += 1;
+		off += head_len + body_len;
+	}
+
+	memmove(client->data, client->data + off, client->used - off);
+	client->used -= off;
+}
+
+static void client_recv(client_t *client)
+{
+	while(1)
+	{
+		if(client->used == client->size)
+		{
+			client->size = client->size ? 2 * client->size : 65536;
+			client->data = realloc(client->data, client->size);
+			if(client->data == NULL)
+				abort();
+		}
+
+		ssize_t n = recv(client->fd, client->data + client->used, client->size - client->used, 0);
+		if(n < 0)
+		{
+			if(errno == EAGAIN)
+				break;
+			// A reset means that the server closed the
+			// connection with requests still unread, as
+			// it does when a connection served too many.
+			if(errno != ECONNRESET)
+				errors += 1;
+			client_reconnect(client);
+			return;
+		}
+
+		if(n == 0)
+		{
+			// Closed by the server. With a new connection
+			// per request, this is how each one ends.
+			client_reconnect(client);
+			return;
+		}
+
+		client->used += n;
+		parse_responses(client);
+
+		if(client->received == batch_count)
+		{
+			if(new_conn_per_request)
+			{
+				client_reconnect(client);
+				return;
+			}
+			client->sent = 0;
+			client->received = 0;
+			client_send(client);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int conns = 50;
+	int depth = 1;
+	double duration = 10;
+	const char *path = "/";
+	const char *file = NULL;
+	int port = 8080;
+
+	int opt;
+	while((opt = getopt(argc, argv, "c:d:p:u:f:n")) != -1)
+	{
+		switch(opt)
+		{
+			case 'c': conns = atoi(optarg); break;
+			case 'd': duration = atof(optarg); break;
+			case 'p': depth = atoi(optarg); break;
+			case 'u': path = optarg; break;
+			case 'f': file = optarg; break;
+			case 'n': new_conn_per_request = 1; break;
+			default:
+			fprintf(stderr, "Usage: %s [-c conns] [-d secs] [-p depth] [-u path] [-f file] [-n] [port]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(optind < argc)
+		port = atoi(argv[optind]);
+
+	if(conns <= 0 || depth <= 0 || (new_conn_per_request && depth != 1))
+	{
+		fprintf(stderr, "ERROR: Bad options\n");
+		return 1;
+	}
+
+	// Build the batch of requests sent at once.
+	char  *requests;
+	size_t requests_len;
+	if(file != NULL)
+	{
+		requests = load_file(file, &requests_len);
+		if(requests == NULL)
+		{
+			fprintf(stderr, "ERROR: Can't read %s\n", file);
+			return 1;
+		}
+	}
+	else
+	{
+		static char buffer[1024];
+		int n = snprintf(buffer, sizeof(buffer), "GET %s HTTP/1.1\r\nHost: localhost\r\n"
+		                 "Connection: %s\r\n\r\n", path, new_conn_per_request ? "close" : "Keep-Alive");
+		requests = buffer;
+		requests_len = n;
+	}
+
+	int count = 0;
+	for(char *p = requests; (p = memmem(p, requests + requests_len - p, "\r\n\r\n", 4)) != NULL; p += 4)
+		count += 1;
+
+	batch_len = requests_len * depth;
+	batch_count = count * depth;
+	batch = malloc(batch_len);
+	if(batch == NULL || count == 0)
+	{
+		fprintf(stderr, "ERROR: No requests\n");
+		return 1;
+	}
+	for(int i = 0; i < depth; i += 1)
+		memcpy(batch + i * requests_len, requests, requests_len);
+
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	epfd = epoll_create1(0);
+	if(epfd < 0)
+	{
+		perror("epoll_create1");
+		return 1;
+	}
+
+	client_t *clients = calloc(conns, sizeof(client_t));
+	if(clients == NULL)
+		abort();
+
+	for(int i = 0; i < conns; i += 1)
+		client_connect(&clients[i]);
+	connects = 0;
+
+	double start = now();
+	double end = start + duration;
+
+	struct epoll_event events[256];
+	while(now() < end)
+	{
+		int num = epoll_wait(epfd, events, sizeof(events)/sizeof(events[0]), 100);
+		for(int i = 0; i < num; i += 1)
+		{
+			client_t *client = events[i].data.ptr;
+
+			if(events[i].events & EPOLLIN)
+				client_recv(client);
+
+			// The batch is sent again when its responses
+			// were received, so this only completes it
+			// when the socket was full.
+			if(client->sent < batch_len)
+				client_send(client);
+		}
+	}
+
+	double elapsed = now() - start;
+
+	printf("%d connections, depth %d, %d requests per batch, %.1f s\n", conns, depth, batch_count, elapsed);
+	printf("  %llu responses, %llu errors, %llu reconnects\n", responses, errors, connects);
+	printf("  %.0f requests/s\n", responses / elapsed);
+	if(new_conn_per_request)
+		printf("  %.0f connections/s\n", connects / elapsed);
+	return 0;
+}
@@ -0,0 +1,142 @@
+// Server used for the measurements in bench/README.md.
+//
+// Build with:
+//   $ gcc -O2 bench/server.c xhttp.c -I. -o server -pthread
+//
+// Usage:
+//   $ ./server [-w workers] [-r routes] [-u] [port]
+//
+//   -w <n>  Number of workers (default 1).
+//   -r <n>  Register <n> routes, "/api/r<i>/items/:d" for
+//           i from 0 to n-1. The requests for the last
+//           route cost the most with -u.
+//   -u      Match the routes with a chain of xh_urlcmp
+//           calls instead of the router.
+//
+// Every other URL gets "Hello, world!".
+
+#include <string.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "xhttp.h"
+
+static xh_handle handle;
+
+static int    route_count;
+static char **route_patterns;
+
+static void route(xh_request *req, xh_response *res, void *userp)
+{
+	(void) req;
+	(void) userp;
+
+	res->status = 200;
+	res->body.str = "Route";
+	xh_header_add(res, "Content-Type", "text/plain");
+}
+
+static void callback(xh_request *req, xh_response *res, void *userp)
+{
+	(void) userp;
+
+	// Only used with -u, the router matches the
+	// routes before calling this.
+	for(int i = 0; i < route_count; i += 1)
+	{
+		long long id;
+		if(!xh_urlcmp(req->URL.str, route_patterns[i], &id))
+		{
+			route(req, res, NULL);
+			return;
+		}
+	}
+
+	res->status = 200;
+	res->body.str = "Hello, world!";
+	xh_header_add(res, "Content-Type", "text/plain");
+}
+
+static void handle_sigterm(int signum)
+{
+	(void) signum;
+	xh_quit(handle);
+}
+
+int main(int argc, char **argv)
+{
+	int workers = 1;
+	int routes = 0;
+	int use_urlcmp = 0;
+	int port = 8080;
+
+	int opt;
+	while((opt = getopt(argc, argv, "w:r:u")) != -1)
+	{
+		switch(opt)
+		{
+			case 'w': workers = atoi(optarg); break;
+			case 'r': routes = atoi(optarg); break;
+			case 'u': use_urlcmp = 1; break;
+			default:
+			fprintf(stderr, "Usage: %s [-w workers] [-r routes] [-u] [port]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(optind < argc)
+		port = atoi(argv[optind]);
+
+	signal(SIGTERM, handle_sigterm);
+	signal(SIGQUIT, handle_sigterm);
+	signal(SIGINT,  handle_sigterm);
+
+	route_patterns = malloc(routes * sizeof(char*));
+	for(int i = 0; i < routes; i += 1)
+	{
+		char buffer[64];
+		snprintf(buffer, sizeof(buffer), "/api/r%d/items/:d", i);
+		route_patterns[i] = strdup(buffer);
+	}
+
+	xh_config config = xh_get_default_configs();
+	config.workers = workers;
+
+	if(use_urlcmp)
+		route_count = routes;
+	else if(routes > 0)
+	{
+#ifdef XH_MAX_CAPTURES
+		xh_router *router = xh_router_create();
+		if(router == NULL)
+		{
+			fprintf(stderr, "ERROR: Out of memory\n");
+			return 1;
+		}
+
+		for(int i = 0; i < routes; i += 1)
+		{
+			const char *error = xh_route(router, XH_GET, route_patterns[i], route, NULL);
+			if(error != NULL)
+			{
+				fprintf(stderr, "ERROR: %s\n", error);
+				return 1;
+			}
+		}
+		config.router = router;
+#else
+		fprintf(stderr, "ERROR: This version has no router, use -u\n");
+		return 1;
+#endif
+	}
+
+	const char *error = xhttp(NULL, port, callback,
+	                          NULL, &handle, &config);
+	if(error != NULL)
+	{
+		fprintf(stderr, "ERROR: %s\n", error);
+		return 1;
+	}
+	fprintf(stderr, "OK\n");
+	return 0;
+}
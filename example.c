@@ -1,6 +1,6 @@
 
 // Build with:
-//   $ gcc example.c xhttp.c -o example
+//   $ gcc example.c xhttp.c -o example -pthread
 #include <string.h>
 #include <signal.h>
 #include <stdlib.h>
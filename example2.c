@@ -1,6 +1,6 @@
 
 // Build with:
-//   $ gcc example2.c xhttp.c -o example2
+//   $ gcc example2.c xhttp.c -o example2 -pthread
 
 #include <string.h>
 #include <signal.h>
@@ -11,32 +11,40 @@
 static xh_handle handle;
 static char buffer[1024];
 
-static void callback(xh_request *req, xh_response *res, void *userp)
+static void get_user(xh_request *req, xh_response *res, void *userp)
 {
-    (void) req;
     (void) userp;
 
-    int post;
-    char username[32];
+    xh_string username = req->captures[0];
 
-    if(!xh_urlcmp(req->URL.str, "/users/:s", 
-                  sizeof(username), username)) {
+    snprintf(buffer, sizeof(buffer), "Hello, %.*s!\n", username.len, username.str);
+    res->status = 200;
+    res->body.str = buffer;
+    xh_header_add(res, "Content-Type", "text/plain");
+}
 
-        snprintf(buffer, sizeof(buffer), "Hello, %s!\n", username);
-        res->status = 200;
-        res->body.str = buffer;
+static void get_post(xh_request *req, xh_response *res, void *userp)
+{
+    (void) userp;
 
-    } else if(!xh_urlcmp(req->URL.str, "/users/:s/posts/:d", 
-              sizeof(username), username, &post)) {
+    xh_string username = req->captures[0];
+    long long post = strtoll(req->captures[1].str, NULL, 10);
 
-        snprintf(buffer, sizeof(buffer), "Hello, %s! You asked for post no. %d!\n", username, post);
-        res->status = 200;
-        res->body.str = buffer;
+    snprintf(buffer, sizeof(buffer), "Hello, %.*s! You asked for post no. %lld!\n", 
+             username.len, username.str, post);
+    res->status = 200;
+    res->body.str = buffer;
+    xh_header_add(res, "Content-Type", "text/plain");
+}
 
-    } else {
-        res->status = 404;
-        res->body.str = "It seems like what you're looking for isn't here! :S";
-    }
+static void callback(xh_request *req, xh_response *res, void *userp)
+{
+    (void) req;
+    (void) userp;
+
+    // Requests that match no route end up here.
+    res->status = 404;
+    res->body.str = "It seems like what you're looking for isn't here! :S";
     xh_header_add(res, "Content-Type", "text/plain");
 }
 
@@ -52,8 +60,26 @@ int main()
     signal(SIGQUIT, handle_sigterm);
     signal(SIGINT,  handle_sigterm);
     
-    const char *error = xhttp(NULL, 8080, callback, 
-                              NULL, &handle, NULL);
+    xh_router *router = xh_router_create();
+    if(router == NULL)
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        return 1;
+    }
+
+    const char *error = xh_route(router, XH_GET, "/users/:s", get_user, NULL);
+    if(error == NULL)
+        error = xh_route(router, XH_GET, "/users/:s/posts/:d", get_post, NULL);
+
+    if(error == NULL)
+    {
+        xh_config config = xh_get_default_configs();
+        config.router = router;
+
+        error = xhttp(NULL, 8080, callback, 
+                      NULL, &handle, &config);
+    }
+    xh_router_free(router);
     if(error != NULL)
     {
         fprintf(stderr, "ERROR: %s\n", error);
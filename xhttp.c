@@ -1,3 +1,10 @@
+// Needed for [accept4].
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+// Files can be bigger than 2GB even where 
+// [off_t] is 32 bits by default.
+#define _FILE_OFFSET_BITS 64
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -5,18 +12,26 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <assert.h>
 #include <limits.h>
+#include <signal.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "xhttp.h"
 
 
@@ -42,15 +57,15 @@
  * | it can, it gives it a [conn_t] structure and registers it into the event loop.             | *
  * |                                                                                            | *
  * | When the event loop signals that a connection sent some data, the data is copied from the  | *
- * | kernel into the user-space buffer of the [conn_t] structure. If the head of the request    | *
- * | wasn't received or was received partially, the character sequence "\r\n\r\n" (a blank line)| *
- * | is searched for inside the downloaded data. The "\r\n\r\n" token signifies the end of the  | *
- * | request's head and the start of it's body. If the head wasn't received the server goes     | *
- * | back to waiting for new events. If the token is found, the head can be parsed and the size | *
- * | of the body determined. If the whole body of the request was received with the head, the   | *
- * | request can already be handled. If the body wasn't received, the servers goes back to      | *
- * | waiting for events until the rest of the body is received. When the body is fully received,| *
- * | the user-provided callback can be called to generate a response.                           | *
+ * | kernel into the user-space buffer of the [conn_t] structure. The new bytes are then fed to | *
+ * | the parser, which consumes the head of the request as it arrives and saves its position in | *
+ * | the [conn_t], so that every byte of the head is scanned once however it's fragmented. If   | *
+ * | the head wasn't fully received, the server goes back to waiting for new events. When the   | *
+ * | blank line that ends the head is reached, the size of the body can be determined. If the   | *
+ * | whole body of the request was received with the head, the request can already be handled.  | *
+ * | If the body wasn't received, the servers goes back to waiting for events until the rest    | *
+ * | of the body is received. When the body is fully received, the user-provided callback can   | *
+ * | be called to generate a response.                                                          | *
  * | One thing to note is that multiple requests could be read from a single [recv], making it  | *
  * | necessary to perform these operations on the input buffer in a loop.                       | *
  * |                                                                                            | *
@@ -58,37 +73,349 @@
  * | error occurres, a 4xx or 5xx response is sent.                                             | *
  * |                                                                                            | *
  * | While handling data input events, the response is never sent directly to the kernel buffer,| *
- * | because the call to [send] could block the server. Instead, the response is written to the | *
- * | [conn_t]'s output buffer. This buffer is only flushed to the kernel when a write-ready     | *
- * | event is triggered for that connection.                                                    | *
+ * | Instead, it's written to the [conn_t]'s output buffer, which is flushed with non-blocking  | *
+ * | [send]s once the input events were handled. Whatever the kernel doesn't accept stays in    | *
+ * | the buffer, and only then the connection is monitored for write-ready events, which flush  | *
+ * | the rest. Connections with nothing left to send aren't woken up by writability.            | *
+ * |                                                                                            | *
+ * | Everything described so far is owned by a [context_t] structure, which represents a single | *
+ * | worker. It's possible to run more than one worker in parallel, each on it's own thread and | *
+ * | with it's own listening socket, epoll instance and connection pool. The listening sockets  | *
+ * | are bound to the same address with SO_REUSEPORT, so the kernel balances new connections    | *
+ * | between the workers. Workers never share state, so no locking is involved. The workers are | *
+ * | grouped by a [server_t] structure, which is what the [xh_handle] refers to.                | *
  * |                                                                                            | *
  * +--------------------------------------------------------------------------------------------+ *
  *                                                                                                */
 
+// Maximum value of [xh_config.buffer_classes].
+#define MAX_BUFFER_CLASSES 16
+
+/* The I/O buffers of the connections are borrowed from
+ * a pool owned by the worker, so that connections don't
+ * need to allocate memory. The pool holds buffers of a
+ * fixed set of sizes (size classes), each double the 
+ * previous one, starting from [base]. Released buffers
+ * are kept in a free list for their class as long as
+ * the total memory held doesn't exceed [budget]. Buffers
+ * bigger than the biggest class are allocated and freed
+ * directly. 
+ *
+ * Every buffer has one more byte than its nominal size,
+ * so that any sub-string of its contents can be made 
+ * zero-terminated.
+ */
+typedef struct {
+	void  *free[MAX_BUFFER_CLASSES];
+	size_t held, budget;
+	uint32_t base;
+	int   classes;
+} buffer_pool_t;
+
+/* Memory that only needs to live as long as the request
+ * that's being served (the parsed headers, the response
+ * headers and anything the callback allocates with
+ * [xh_alloc]) is allocated from a per-connection arena.
+ * Allocating just moves a cursor forward and everything 
+ * is released at once after the response is written to
+ * the output buffer. The arena is made of blocks that
+ * are borrowed from the buffer pool. The first block is
+ * kept between requests, so usually serving a request
+ * doesn't involve calls to the allocator.
+ */
+typedef struct arena_block_t arena_block_t;
+struct arena_block_t {
+	arena_block_t *next;
+	uint32_t size;
+	uint32_t used;
+	_Alignas(16) char data[];
+};
+
+typedef struct {
+	buffer_pool_t *pool;
+	arena_block_t *head;
+	
+	// Last allocation, which can be grown
+	// in place.
+	void *last;
+} arena_t;
+
 typedef enum { 
 	XH_REQ, 
 	XH_RES 
 } struct_type_t;
 
+// Borrowed response bodies at least this big are
+// written to the socket right after the response is
+// generated instead of being copied into the output 
+// buffer first.
+#define INLINE_WRITE_THRESHOLD 4096
+
 typedef struct {
 	struct_type_t type;
 	xh_response public;
 	xh_table   headers;
 	int capacity;
 	bool failed;
+
+	// Where the headers are allocated.
+	arena_t *arena;
+
+	// Set by [xh_defer]. The token identifies
+	// the connection the response is for.
+	bool     deferred;
+	xh_token token;
+
+	// Set by [xh_stream].
+	xh_body_callback stream_callback;
+	void            *stream_userp;
+
+	// See [xh_request2.header_slots].
+	int header_slots[XH_HDR_COUNT];
 } xh_response2;
 
 typedef struct {
 	struct_type_t type;
 	xh_request  public;
+
+	// For each [xh_header_id], the index plus one 
+	// of the first header with that name or 0 if
+	// there's none.
+	int header_slots[XH_HDR_COUNT];
 } xh_request2;
 
+// The contents of a buffer are the bytes from [head]
+// to [used]. Bytes are consumed from the front by moving
+// [head] forward, so that nothing is copied. The space 
+// before [head] is only reclaimed by moving the contents
+// back when more space is needed at the end. When all
+// contents are consumed, both cursors go back to 0.
 typedef struct {
 	char    *data;
 	uint32_t size;
+	uint32_t head;
 	uint32_t used;
 } buffer_t;
 
+// States of the request head parser. Each one
+// is named after what's expected next.
+typedef enum {
+	PARSE_METHOD,
+	PARSE_SPACE_AFTER_METHOD,
+	PARSE_URL,
+	PARSE_PARAMS,
+	PARSE_SPACE_AFTER_URL,
+	PARSE_VERSION,
+	PARSE_VERSION_LF,
+	PARSE_HEADER_START,
+	PARSE_HEADER_NAME,
+	PARSE_HEADER_VALUE,
+	PARSE_HEADER_LF,
+	PARSE_BLANK_LF,
+	PARSE_DONE,
+} parse_state_t;
+
+typedef struct {
+	uint32_t name, name_len;
+	uint32_t value, value_len;
+} header_span_t;
+
+// The parser consumes the head of a request as it
+// arrives, so it keeps its position between calls.
+// Since the input buffer can be moved while the head
+// is incomplete, everything is stored as offsets from
+// the start of the request. Pointers are only created
+// once the whole head was parsed.
+typedef struct {
+	parse_state_t state;
+
+	// Offset of the first byte that wasn't
+	// scanned yet. When the state is 
+	// [PARSE_DONE], it's the length of the 
+	// head.
+	uint32_t cur;
+
+	// Offset of the token being scanned.
+	uint32_t mark;
+
+	uint32_t method_offset,  method_length;
+	uint32_t    URL_offset,     URL_length;
+	uint32_t params_offset,  params_length;
+	uint32_t version_offset, version_length;
+
+	// Name of the header whose value
+	// is being scanned.
+	uint32_t hname_offset, hname_length;
+
+	header_span_t *headers;
+	int            header_count;
+	int            header_capacity;
+} parser_t;
+
+// States of the chunked body decoder. Each one
+// is named after what's expected next.
+typedef enum {
+	CHUNK_SIZE,
+	CHUNK_EXTENSION,
+	CHUNK_SIZE_LF,
+	CHUNK_DATA,
+	CHUNK_DATA_CR,
+	CHUNK_DATA_LF,
+	CHUNK_TRAILER,
+	CHUNK_TRAILER_LINE,
+	CHUNK_TRAILER_LF,
+	CHUNK_LAST_LF,
+	CHUNK_DONE,
+} chunk_state_t;
+
+// A chunked body is decoded in place as it arrives:
+// the data of each chunk is moved back over the 
+// framing that preceded it, so that the decoded
+// body is contiguous and directly follows the head.
+typedef struct {
+	bool          active;
+	chunk_state_t state;
+
+	// Set once the size of the current
+	// chunk has at least one digit.
+	bool digits;
+
+	// Size of the current chunk or, while
+	// its data is being received, what's
+	// left of it.
+	uint64_t left;
+
+	// Number of chunks received.
+	uint32_t count;
+} dechunker_t;
+
+// An open file cached for [xh_response.file]
+// responses, along with its metadata.
+typedef struct file_entry_t file_entry_t;
+struct file_entry_t {
+
+	// Links of the LRU list (most recently
+	// used first) and of the chains of the
+	// tables by path and by inotify watch.
+	file_entry_t *prev, *next;
+	file_entry_t *path_next;
+	file_entry_t *wd_next;
+
+	char    *path;
+	uint32_t hash;
+
+	int fd;
+	int wd; // Watch descriptor or -1.
+
+	struct stat info;
+
+	// Time in milliseconds after which the 
+	// entry must be reopened, or 0 if it's 
+	// only invalidated by inotify.
+	uint64_t expire;
+
+	// Number of responses using [fd]. While
+	// it's not 0 the entry isn't freed, even
+	// if it was removed from the cache.
+	int  refs;
+	bool cached;
+};
+
+// Each worker keeps the files it recently served
+// open. Entries are removed when inotify reports
+// that the file changed (or when they expire, if
+// inotify isn't available) and when the cache is
+// full and space is needed for new ones.
+typedef struct {
+	file_entry_t **by_path;
+	file_entry_t **by_wd;
+	uint32_t       mask; // Size of the tables minus 1.
+
+	file_entry_t *head, *tail;
+
+	uint32_t count, capacity;
+	uint32_t ttl; // Seconds.
+
+	int inotify; // -1 if not available.
+} file_cache_t;
+
+// A response stored by the response cache. The
+// memory after the structure holds the body, then
+// the head (the status line and the headers that
+// don't depend on the connection), the key and the
+// vary list of the response and the values its
+// vary headers had in the request.
+typedef struct response_entry_t response_entry_t;
+struct response_entry_t {
+
+	// Links of the LRU list (most recently used
+	// first) and of the chain of the table.
+	response_entry_t *prev, *next;
+	response_entry_t *key_next;
+
+	uint32_t hash;
+	uint64_t expire; // Milliseconds.
+	size_t   size;
+
+	xh_string body;
+	xh_string head;
+	xh_string key;  // Host, '\0', URL, '?' and parameters.
+	xh_string vary; // Comma-separated header names.
+	xh_string vary_values; // Zero-terminated, one after the other.
+
+	int  status;
+	bool close;
+
+	// Number of responses sending [body]. While
+	// it's not 0 the entry isn't freed, even if
+	// it was removed from the cache.
+	int  refs;
+	bool cached;
+};
+
+// Each worker keeps the responses marked with
+// [xh_response.cache_ttl] until they expire or
+// the [capacity] (in bytes) is needed for newer
+// ones.
+typedef struct {
+	response_entry_t **by_key;
+	uint32_t           mask; // Size of the table minus 1.
+
+	response_entry_t *head, *tail;
+
+	size_t used, capacity;
+} response_cache_t;
+
+typedef struct {
+	uint64_t first, last;
+} byte_range_t;
+
+// The parts of a multipart/byteranges response
+// to a request for more than one range of a file.
+// [next] is the index of the range that will be
+// sent after the current one.
+typedef struct {
+	int  count, next;
+	char boundary[17];
+	char *content_type; // NULL if the file has none.
+	uint64_t     size;  // Of the whole file.
+	byte_range_t ranges[];
+} multipart_t;
+
+// What a connection's timer is measuring. Header,
+// idle and defer timers aren't pushed forward when 
+// data arrives, so that a client can't hold a connection
+// by trickling bytes. The others are re-armed on every
+// event, so they measure the time without progress.
+typedef enum {
+	TIMER_NONE,
+	TIMER_HEADER,
+	TIMER_BODY,
+	TIMER_WRITE,
+	TIMER_IDLE,
+	TIMER_DEFER,
+} timer_kind_t;
+
 typedef struct conn_t conn_t;
 struct conn_t {
 
@@ -104,12 +431,56 @@ struct conn_t {
 	// descriptor.
 	int fd;
 
+	// Incremented every time the structure
+	// is released. Tokens of deferred responses
+	// store it to tell apart a previous user
+	// of the structure.
+	uint32_t gen;
+
+	// Events the socket is monitored for. 
+	// EPOLLOUT is only included while there
+	// is output that couldn't be sent.
+	uint32_t events;
+
 	// Number of resources served to
 	// this client. This is used to
 	// determine which connections to
-	// keep alive.
+	// keep alive. Tokens of deferred
+	// responses also store it, to tell
+	// apart the requests of the same
+	// connection.
 	int served;
 
+	// Links of the timer wheel slot list 
+	// this connection is in, if any. The
+	// connection is closed when the current 
+	// time reaches [deadline] (in ticks).
+	conn_t  *timer_prev;
+	conn_t  *timer_next;
+	uint64_t deadline;
+	timer_kind_t timer_kind;
+
+	// Links of the context's ready list, which
+	// holds the connections that still have
+	// work to do that no event will be reported
+	// for. [throttled] is set when [upload] 
+	// stopped because the connection used its
+	// budget, not because the socket was full.
+	// Likewise, [read_throttled] and [serve_throttled]
+	// are set when reading from the socket or
+	// serving the buffered requests stopped 
+	// because the connection used its read or
+	// request budget. [turn_requests] counts the
+	// requests served since it was last given
+	// its turn.
+	conn_t *ready_prev;
+	conn_t *ready_next;
+	bool    ready;
+	bool    throttled;
+	bool    read_throttled;
+	bool    serve_throttled;
+	uint32_t turn_requests;
+
 	// This flags can be set after a
 	// response is written to the output
 	// buffer. If set, then all reads
@@ -133,10 +504,82 @@ struct conn_t {
 	// would have returned.
 	bool failed_to_append;
 
-	bool sending_from_fd;
-	int  file_fd;
-	int  file_off;
-	int  file_len;
+	// Body of the last response, when it's
+	// sent directly from the memory provided
+	// by the callback instead of being copied
+	// into the output buffer. It's sent after
+	// the output buffer's contents and then
+	// released with [res_body_release].
+	xh_string res_body;
+	uint32_t  res_body_sent;
+	void    (*res_body_release)(void*);
+
+	// Producer of the body of the last response,
+	// when it's generated while it's sent. See
+	// [xh_response.producer].
+	int  (*producer)(char *dst, int max, void *userp);
+	void  *producer_userp;
+	bool   chunked;
+
+	// The file being sent. Its [file_fd] is
+	// owned by [file_entry] if it's cached, so
+	// it's shared with other connections and the
+	// file offset can't be used.
+	bool     sending_from_fd;
+	int      file_fd;
+	uint64_t file_off;
+	uint64_t file_len;
+	file_entry_t *file_entry;
+
+	// Set when the file is being sent as a
+	// multipart/byteranges body. [file_off]
+	// and [file_len] then refer to the range
+	// being sent.
+	multipart_t *parts;
+
+	// Memory for the request being served.
+	arena_t arena;
+
+	// State of the parser while the head of 
+	// the request isn't fully received.
+	parser_t parser;
+
+	// Set when reading stopped because the head
+	// limit was reached and serving couldn't make
+	// room. Reading resumes when the response in
+	// progress is sent.
+	bool input_full;
+	// Set while the response to the request 
+	// being served was deferred by the callback.
+	// Nothing is read from the socket until it's
+	// completed, so that the request stays where
+	// it is in the input buffer. [head_only] and
+	// [byte_after_body] hold the state needed to
+	// finish serving the request.
+	bool deferred;
+	bool head_only;
+	char byte_after_body;
+
+	// Set while the body of the request being
+	// served is streamed to the callback. The
+	// body isn't part of the request in the 
+	// input buffer ([body_length] is 0). The
+	// bytes that arrive after the head are 
+	// passed to [stream_callback] and removed
+	// until [body_left] reaches 0. While 
+	// [paused], nothing is read from the socket.
+	bool     streaming;
+	bool     paused;
+	uint64_t body_left;
+	xh_body_callback stream_callback;
+	void            *stream_userp;
+
+	// Decoder of the body of the request being
+	// served, if it uses chunked encoding. The
+	// [body_length] bytes after [body_offset]
+	// are the part of it that was decoded and
+	// the undecoded bytes follow them.
+	dechunker_t dechunker;
 
 	bool   head_received;
 	uint32_t body_offset;
@@ -145,167 +588,651 @@ struct conn_t {
 };
 
 typedef struct {
-	bool exiting;
+	uint32_t    slot;
+	uint32_t    gen;
+	uint32_t    seq;
+	xh_callback callback;
+	void       *userp;
+} completion_t;
+
+// Connection timeouts are tracked by a hashed timer
+// wheel. Time is divided in ticks of [TIMER_TICK_MS]
+// and a connection whose deadline is tick T is in
+// slot T % TIMER_SLOTS. Deadlines further away than
+// a full turn of the wheel are left in their slot
+// until their turn comes. Arming and disarming a 
+// timer is just a list insertion or removal.
+#define TIMER_TICK_MS 1000
+#define TIMER_SLOTS 64
+
+typedef struct {
+	conn_t  *slots[TIMER_SLOTS];
+	uint64_t current; // Last tick that was processed.
+	int      armed;   // Number of connections in the wheel.
+} timer_wheel_t;
+
+typedef struct {
+	atomic_bool exiting;
 	int fd, epfd, maxconns, connum;
+
+	// Maximum number of connections accepted
+	// per listener event.
+	unsigned int accept_budget;
+
+	// Keep-alive policy. See [xh_config].
+	unsigned int keep_alive_max_requests;
+	unsigned int keep_alive_timeout;
+	unsigned int keep_alive_threshold;
+
+	// See [xh_config].
+	uint32_t max_buffered_body;
+	bool     stream_bodies;
+	uint32_t max_body_chunks;
+	uint64_t sendfile_budget;
+	uint32_t read_budget;
+	uint32_t request_budget;
+
+	// Timeouts in seconds. See [xh_config].
+	unsigned int header_timeout;
+	unsigned int body_timeout;
+	unsigned int write_timeout;
+
+	timer_wheel_t timers;
+
+	// Connections to serve again without waiting
+	// for events. See [conn_t.ready].
+	conn_t *ready_head;
+	conn_t *ready_tail;
+
+	// Deferred responses completed with [xh_respond].
+	// They're queued by any thread and handled by the
+	// worker when it's woken up through [wakefd].
+	pthread_mutex_t completions_lock;
+	completion_t   *completions;
+	int             completions_count;
+	int             completions_capacity;
+
+	// Counters reported by [xh_get_stats]. They're
+	// only written by this worker, but may be read
+	// by any thread.
+	struct {
+		atomic_ullong wakeups;
+		atomic_ullong events;
+		atomic_ullong requests;
+		atomic_ullong connections;
+		atomic_ullong write_waits;
+		atomic_ullong cache_hits;
+		atomic_ullong cache_misses;
+		atomic_ullong cache_evictions;
+	} stats;
 	conn_t *pool, *freelist;
+	buffer_pool_t buffers;
+	file_cache_t  files;
+	response_cache_t responses;
 	xh_callback callback;
 	void *userp;
+
+	// Shared by all workers. It's not modified
+	// while the server runs, so no lock is needed.
+	const xh_router *router;
+
+	// Index of this worker.
+	unsigned int worker;
+
+	// The "Date" header line of the responses, which
+	// is only formatted when the second changes. See
+	// [update_date].
+	char   date_line[64];
+	int    date_len;
+	time_t date_time;
+
+	// Thread running this worker's event loop.
+	// The first worker runs on the thread that
+	// called [xhttp], so its [thread] is unused.
+	pthread_t thread;
+
+	// Event file descriptor registered in the 
+	// epoll. Writing to it wakes up the event 
+	// loop (this is used by [xh_quit]).
+	int wakefd;
+
+	// See [xh_config].
+	uint32_t max_head_size;
 } context_t;
 
-static const char *statis_code_to_status_text(int code)
-{
-	switch(code)
-	{
-		case 100: return "Continue";
-		case 101: return "Switching Protocols";
-		case 102: return "Processing";
-
-		case 200: return "OK";
-		case 201: return "Created";
-		case 202: return "Accepted";
-		case 203: return "Non-Authoritative Information";
-		case 204: return "No Content";
-		case 205: return "Reset Content";
-		case 206: return "Partial Content";
-		case 207: return "Multi-Status";
-		case 208: return "Already Reported";
-
-		case 300: return "Multiple Choices";
-		case 301: return "Moved Permanently";
-		case 302: return "Found";
-		case 303: return "See Other";
-		case 304: return "Not Modified";
-		case 305: return "Use Proxy";
-		case 306: return "Switch Proxy";
-		case 307: return "Temporary Redirect";
-		case 308: return "Permanent Redirect";
-
-		case 400: return "Bad Request";
-		case 401: return "Unauthorized";
-		case 402: return "Payment Required";
-		case 403: return "Forbidden";
-		case 404: return "Not Found";
-		case 405: return "Method Not Allowed";
-		case 406: return "Not Acceptable";
-		case 407: return "Proxy Authentication Required";
-		case 408: return "Request Timeout";
-		case 409: return "Conflict";
-		case 410: return "Gone";
-		case 411: return "Length Required";
-		case 412: return "Precondition Failed";
-		case 413: return "Request Entity Too Large";
-		case 414: return "Request-URI Too Long";
-		case 415: return "Unsupported Media Type";
-		case 416: return "Requested Range Not Satisfiable";
-		case 417: return "Expectation Failed";
-		case 418: return "I'm a teapot";
-		case 420: return "Enhance your calm";
-		case 422: return "Unprocessable Entity";
-		case 426: return "Upgrade Required";
-		case 429: return "Too many requests";
-		case 431: return "Request Header Fields Too Large";
-		case 449: return "Retry With";
-		case 451: return "Unavailable For Legal Reasons";
-
-		case 500: return "Internal Server Error";
-		case 501: return "Not Implemented";
-		case 502: return "Bad Gateway";
-		case 503: return "Service Unavailable";
-		case 504: return "Gateway Timeout";
-		case 505: return "HTTP Version Not Supported";
-		case 509: return "Bandwidth Limit Exceeded";
-	}
-	return "???";
-}
+typedef struct {
+	context_t   *workers;
+	unsigned int count;
+} server_t;
 
-/* Symbol: find_header
- *
- *   Finds the header from a header array.
+/* Symbol: status_lines
  *
- * Arguments:
+ *   Complete status lines of the known status codes,
+ *   indexed by code minus 100, so that they can be
+ *   written without being formatted.
+ */
+#define STATUS_LINE(code, text) \
+	[code - 100] = { "HTTP/1.1 " #code " " text "\r\n", sizeof("HTTP/1.1 " #code " " text "\r\n")-1 }
+static const xh_string status_lines[500] = {
+	STATUS_LINE(100, "Continue"),
+	STATUS_LINE(101, "Switching Protocols"),
+	STATUS_LINE(102, "Processing"),
+
+	STATUS_LINE(200, "OK"),
+	STATUS_LINE(201, "Created"),
+	STATUS_LINE(202, "Accepted"),
+	STATUS_LINE(203, "Non-Authoritative Information"),
+	STATUS_LINE(204, "No Content"),
+	STATUS_LINE(205, "Reset Content"),
+	STATUS_LINE(206, "Partial Content"),
+	STATUS_LINE(207, "Multi-Status"),
+	STATUS_LINE(208, "Already Reported"),
+
+	STATUS_LINE(300, "Multiple Choices"),
+	STATUS_LINE(301, "Moved Permanently"),
+	STATUS_LINE(302, "Found"),
+	STATUS_LINE(303, "See Other"),
+	STATUS_LINE(304, "Not Modified"),
+	STATUS_LINE(305, "Use Proxy"),
+	STATUS_LINE(306, "Switch Proxy"),
+	STATUS_LINE(307, "Temporary Redirect"),
+	STATUS_LINE(308, "Permanent Redirect"),
+
+	STATUS_LINE(400, "Bad Request"),
+	STATUS_LINE(401, "Unauthorized"),
+	STATUS_LINE(402, "Payment Required"),
+	STATUS_LINE(403, "Forbidden"),
+	STATUS_LINE(404, "Not Found"),
+	STATUS_LINE(405, "Method Not Allowed"),
+	STATUS_LINE(406, "Not Acceptable"),
+	STATUS_LINE(407, "Proxy Authentication Required"),
+	STATUS_LINE(408, "Request Timeout"),
+	STATUS_LINE(409, "Conflict"),
+	STATUS_LINE(410, "Gone"),
+	STATUS_LINE(411, "Length Required"),
+	STATUS_LINE(412, "Precondition Failed"),
+	STATUS_LINE(413, "Request Entity Too Large"),
+	STATUS_LINE(414, "Request-URI Too Long"),
+	STATUS_LINE(415, "Unsupported Media Type"),
+	STATUS_LINE(416, "Requested Range Not Satisfiable"),
+	STATUS_LINE(417, "Expectation Failed"),
+	STATUS_LINE(418, "I'm a teapot"),
+	STATUS_LINE(420, "Enhance your calm"),
+	STATUS_LINE(422, "Unprocessable Entity"),
+	STATUS_LINE(426, "Upgrade Required"),
+	STATUS_LINE(429, "Too many requests"),
+	STATUS_LINE(431, "Request Header Fields Too Large"),
+	STATUS_LINE(449, "Retry With"),
+	STATUS_LINE(451, "Unavailable For Legal Reasons"),
+
+	STATUS_LINE(500, "Internal Server Error"),
+	STATUS_LINE(501, "Not Implemented"),
+	STATUS_LINE(502, "Bad Gateway"),
+	STATUS_LINE(503, "Service Unavailable"),
+	STATUS_LINE(504, "Gateway Timeout"),
+	STATUS_LINE(505, "HTTP Version Not Supported"),
+	STATUS_LINE(509, "Bandwidth Limit Exceeded"),
+};
+#undef STATUS_LINE
+
+static uint32_t buffer_count(buffer_t *b)
+{
+	return b->used - b->head;
+}
+
+static void buffer_consume(buffer_t *b, uint32_t n)
+{
+	assert(n <= buffer_count(b));
+
+	b->head += n;
+
+	if(b->head == b->used)
+	{
+		b->head = 0;
+		b->used = 0;
+	}
+}
+
+/* Symbol: buffer_compact
  *
- *   - headers: The header set array.
+ *   Move the contents of a buffer to the start of
+ *   its memory, so that all free space is at the end.
+ */
+static void buffer_compact(buffer_t *b)
+{
+	if(b->head > 0)
+	{
+		memmove(b->data, b->data + b->head, b->used - b->head);
+		b->used -= b->head;
+		b->head = 0;
+	}
+}
+
+static int buffer_class(buffer_pool_t *pool, uint32_t size)
+{
+	for(int i = 0; i < pool->classes; i += 1)
+		if(size <= (pool->base << i))
+			return i;
+	return -1;
+}
+
+/* Symbol: pool_get
  *
- *   - name: Zero-terminated string that contains the 
- *           header's name. The comparison with each 
- *           header's name is made using [xh_header_cmp],
- *           so it's not case-sensitive.
+ *   Borrow a buffer of at least [min_size] bytes from
+ *   the pool. The actual size is returned through
+ *   [size].
  *
  * Returns:
- *   The index in the array of the matched header, or
- *   -1 is no header was found.
+ *   The buffer or NULL if there's no memory.
  */
-static int find_header(xh_table headers, const char *name)
+static char *pool_get(buffer_pool_t *pool, uint32_t min_size, uint32_t *size)
 {
-	for(int i = 0; i < headers.count; i += 1)
-		if(xh_header_cmp(name, headers.list[i].key.str))
-			return i;
-	return -1;
+	int k = buffer_class(pool, min_size);
+
+	if(k < 0)
+	{
+		// Too big to be pooled.
+		*size = min_size;
+		return malloc(min_size + 1);
+	}
+
+	*size = pool->base << k;
+
+	char *mem = pool->free[k];
+	if(mem == NULL)
+		return malloc(*size + 1);
+
+	memcpy(&pool->free[k], mem, sizeof(void*));
+	pool->held -= *size;
+	return mem;
 }
 
-/* Symbol: xh_header_add
+/* Symbol: pool_put
  *
- *   Add or replace a header into a response object.
+ *   Give back a buffer of [size] bytes that was
+ *   obtained using [pool_get].
+ */
+static void pool_put(buffer_pool_t *pool, char *mem, uint32_t size)
+{
+	if(mem == NULL)
+		return;
+
+	int k = buffer_class(pool, size);
+
+	if(k < 0 || (pool->base << k) != size || pool->held + size > pool->budget)
+	{
+		free(mem);
+		return;
+	}
+
+	memcpy(mem, &pool->free[k], sizeof(void*));
+	pool->free[k] = mem;
+	pool->held += size;
+}
+
+static void pool_free(buffer_pool_t *pool)
+{
+	for(int i = 0; i < pool->classes; i += 1)
+		while(pool->free[i] != NULL)
+		{
+			char *mem = pool->free[i];
+			memcpy(&pool->free[i], mem, sizeof(void*));
+			free(mem);
+		}
+	pool->held = 0;
+}
+
+/* Symbol: buffer_reserve
  *
- * Arguments:
+ *   Make sure that at least [min_free] bytes can be
+ *   written at the end of the buffer, by compacting
+ *   its contents or moving them to a bigger buffer
+ *   from the pool.
  *
- *   - res: The response object.
+ * Returns:
+ *   1 on success, 0 if there's no memory.
+ */
+static bool buffer_reserve(buffer_pool_t *pool, buffer_t *b, uint32_t min_free)
+{
+	if(b->size - b->used >= min_free)
+		return 1;
+
+	buffer_compact(b);
+
+	if(b->size - b->used >= min_free)
+		return 1;
+
+	uint32_t min_size = 2 * b->size;
+	if(min_size < b->used + min_free)
+		min_size = b->used + min_free;
+
+	uint32_t new_size;
+	char *new_data = pool_get(pool, min_size, &new_size);
+
+	if(new_data == NULL)
+		return 0;
+
+	if(b->used > 0)
+		memcpy(new_data, b->data, b->used);
+
+	pool_put(pool, b->data, b->size);
+	b->data = new_data;
+	b->size = new_size;
+	return 1;
+}
+
+/* Symbol: buffer_release
  *
- *   - name: Zero-terminated string that contains
- *           the header's name. The comparison with
- *           each header's name is made using [xh_header_cmp],
- *           so it's not case-sensitive.
+ *   Give the memory of an empty buffer back to the
+ *   pool.
+ */
+static void buffer_release(buffer_pool_t *pool, buffer_t *b)
+{
+	assert(buffer_count(b) == 0);
+	pool_put(pool, b->data, b->size);
+	b->data = NULL;
+	b->size = 0;
+	b->head = 0;
+	b->used = 0;
+}
+
+// Size of the blocks the arenas are made of.
+#define ARENA_BLOCK_SIZE 4096
+
+/* Symbol: arena_alloc
  *
- *   - valfmt: A printf-like format string that evaluates
- *             to the header's value.
+ *   Allocate memory from an arena. The memory is 
+ *   aligned to 16 bytes and is valid until the arena 
+ *   is reset.
  *
  * Returns:
- *   Nothing. The header may or may not be added
- *   (or replaced) to the request.
+ *   The allocated memory or NULL if there's no memory.
  */
-void xh_header_add(xh_response *res, const char *name, const char *valfmt, ...)
+static void *arena_alloc(arena_t *arena, size_t size)
 {
-	xh_response2 *res2 = (xh_response2*) ((char*) res - offsetof(xh_response2, public));
+	if(size > UINT32_MAX / 2)
+		return NULL;
 
-	assert(&res2->public == res);
+	uint32_t aligned = (size + 15) & ~(uint32_t) 15;
 
-	if(res2->failed)
-		return;
+	arena_block_t *block = arena->head;
+
+	if(block == NULL || block->size - block->used < aligned)
+	{
+		uint32_t min_size = sizeof(arena_block_t) + aligned;
+		if(min_size < ARENA_BLOCK_SIZE)
+			min_size = ARENA_BLOCK_SIZE;
 
-	int i = find_header(res2->headers, name);
+		uint32_t block_size;
+		block = (arena_block_t*) pool_get(arena->pool, min_size, &block_size);
 
-	unsigned int name_len, value_len;
+		if(block == NULL)
+			return NULL;
 
-	name_len = name == NULL ? 0 : strlen(name);
+		block->next = arena->head;
+		block->size = block_size - sizeof(arena_block_t);
+		block->used = 0;
+		arena->head = block;
+	}
+
+	void *ptr = block->data + block->used;
+	block->used += aligned;
+	arena->last = ptr;
+	return ptr;
+}
+
+/* Symbol: arena_peek
+ *
+ *   Get the free memory at the end of the arena's 
+ *   current block, [*size] bytes long, without 
+ *   allocating it. Allocating up to [*size] bytes
+ *   right after returns the same memory, so it can
+ *   be written first and kept only if it's enough.
+ */
+static char *arena_peek(arena_t *arena, uint32_t *size)
+{
+	arena_block_t *block = arena->head;
 
-	char value[512];
+	if(block == NULL)
 	{
-		va_list args;
-		va_start(args, valfmt);
-		int n = vsnprintf(value, sizeof(value), valfmt, args);
-		va_end(args);
+		*size = 0;
+		return NULL;
+	}
 
-		if(n < 0)
-		{
-			// Bad format.
-			res2->failed = 1;
-			return;
-		}
+	// Allocations are rounded up to 16 bytes.
+	*size = (block->size - block->used) & ~(uint32_t) 15;
+	return block->data + block->used;
+}
+
+/* Symbol: arena_realloc
+ *
+ *   Resize an allocation made from an arena. If it's
+ *   the last one, it's resized in place when possible.
+ */
+static void *arena_realloc(arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+	if(ptr != NULL && ptr == arena->last && new_size <= UINT32_MAX / 2)
+	{
+		arena_block_t *block = arena->head;
 
-		if((unsigned int) n >= sizeof(value))
+		uint32_t offset  = (char*) ptr - block->data;
+		uint32_t aligned = (new_size + 15) & ~(uint32_t) 15;
+
+		if(offset + aligned <= block->size)
 		{
-			// Static buffer is too small.
-			res2->failed = 1;
-			return;
+			block->used = offset + aligned;
+			return ptr;
 		}
+	}
+
+	void *mem = arena_alloc(arena, new_size);
+
+	if(mem != NULL && ptr != NULL)
+		memcpy(mem, ptr, old_size);
+
+	return mem;
+}
+
+/* Symbol: arena_reset
+ *
+ *   Release all allocations made from an arena. The 
+ *   first block is kept for the next allocations.
+ */
+static void arena_reset(arena_t *arena)
+{
+	arena_block_t *block = arena->head;
+
+	if(block == NULL)
+		return;
+
+	while(block->next != NULL)
+	{
+		arena_block_t *next = block->next;
+		pool_put(arena->pool, (char*) block, block->size + sizeof(arena_block_t));
+		block = next;
+	}
+
+	block->used = 0;
+	arena->head = block;
+	arena->last = NULL;
+}
+
+static void arena_free(arena_t *arena)
+{
+	arena_reset(arena);
 
-		value_len = n;
+	if(arena->head != NULL)
+	{
+		arena_block_t *block = arena->head;
+		pool_put(arena->pool, (char*) block, block->size + sizeof(arena_block_t));
+		arena->head = NULL;
 	}
+}
+
+/* Symbol: header_names
+ *
+ *   Lowercase names of the well-known headers, in
+ *   the order of [xh_header_id].
+ */
+#define NAME(s) { s, sizeof(s)-1 }
+static const xh_string header_names[XH_HDR_COUNT] = {
+	[XH_HDR_ACCEPT]              = NAME("accept"),
+	[XH_HDR_ACCEPT_ENCODING]     = NAME("accept-encoding"),
+	[XH_HDR_ACCEPT_LANGUAGE]     = NAME("accept-language"),
+	[XH_HDR_AUTHORIZATION]       = NAME("authorization"),
+	[XH_HDR_CACHE_CONTROL]       = NAME("cache-control"),
+	[XH_HDR_CONNECTION]          = NAME("connection"),
+	[XH_HDR_CONTENT_ENCODING]    = NAME("content-encoding"),
+	[XH_HDR_CONTENT_LENGTH]      = NAME("content-length"),
+	[XH_HDR_CONTENT_RANGE]       = NAME("content-range"),
+	[XH_HDR_CONTENT_TYPE]        = NAME("content-type"),
+	[XH_HDR_COOKIE]              = NAME("cookie"),
+	[XH_HDR_DATE]                = NAME("date"),
+	[XH_HDR_ETAG]                = NAME("etag"),
+	[XH_HDR_EXPECT]              = NAME("expect"),
+	[XH_HDR_HOST]                = NAME("host"),
+	[XH_HDR_IF_MATCH]            = NAME("if-match"),
+	[XH_HDR_IF_MODIFIED_SINCE]   = NAME("if-modified-since"),
+	[XH_HDR_IF_NONE_MATCH]       = NAME("if-none-match"),
+	[XH_HDR_IF_RANGE]            = NAME("if-range"),
+	[XH_HDR_IF_UNMODIFIED_SINCE] = NAME("if-unmodified-since"),
+	[XH_HDR_KEEP_ALIVE]          = NAME("keep-alive"),
+	[XH_HDR_LAST_MODIFIED]       = NAME("last-modified"),
+	[XH_HDR_LOCATION]            = NAME("location"),
+	[XH_HDR_ORIGIN]              = NAME("origin"),
+	[XH_HDR_RANGE]               = NAME("range"),
+	[XH_HDR_REFERER]             = NAME("referer"),
+	[XH_HDR_SERVER]              = NAME("server"),
+	[XH_HDR_SET_COOKIE]          = NAME("set-cookie"),
+	[XH_HDR_TRANSFER_ENCODING]   = NAME("transfer-encoding"),
+	[XH_HDR_UPGRADE]             = NAME("upgrade"),
+	[XH_HDR_USER_AGENT]          = NAME("user-agent"),
+};
+#undef NAME
+
+// Maps the hash of a well-known header's name
+// to its [xh_header_id] plus one. See [header_id].
+static const uint8_t header_table[64] = {
+	[ 0] = XH_HDR_KEEP_ALIVE + 1,
+	[ 1] = XH_HDR_UPGRADE + 1,
+	[ 7] = XH_HDR_SERVER + 1,
+	[ 8] = XH_HDR_TRANSFER_ENCODING + 1,
+	[11] = XH_HDR_ACCEPT_ENCODING + 1,
+	[13] = XH_HDR_IF_MATCH + 1,
+	[14] = XH_HDR_AUTHORIZATION + 1,
+	[24] = XH_HDR_SET_COOKIE + 1,
+	[26] = XH_HDR_CACHE_CONTROL + 1,
+	[28] = XH_HDR_COOKIE + 1,
+	[31] = XH_HDR_ORIGIN + 1,
+	[32] = XH_HDR_IF_RANGE + 1,
+	[35] = XH_HDR_USER_AGENT + 1,
+	[37] = XH_HDR_ACCEPT_LANGUAGE + 1,
+	[38] = XH_HDR_LOCATION + 1,
+	[39] = XH_HDR_EXPECT + 1,
+	[40] = XH_HDR_CONTENT_ENCODING + 1,
+	[41] = XH_HDR_IF_UNMODIFIED_SINCE + 1,
+	[43] = XH_HDR_DATE + 1,
+	[47] = XH_HDR_CONNECTION + 1,
+	[49] = XH_HDR_CONTENT_LENGTH + 1,
+	[51] = XH_HDR_ACCEPT + 1,
+	[52] = XH_HDR_RANGE + 1,
+	[53] = XH_HDR_REFERER + 1,
+	[54] = XH_HDR_CONTENT_TYPE + 1,
+	[55] = XH_HDR_LAST_MODIFIED + 1,
+	[56] = XH_HDR_HOST + 1,
+	[57] = XH_HDR_CONTENT_RANGE + 1,
+	[59] = XH_HDR_IF_MODIFIED_SINCE + 1,
+	[60] = XH_HDR_IF_NONE_MATCH + 1,
+	[62] = XH_HDR_ETAG + 1,
+};
+
+/* Symbol: header_id
+ *
+ *   Classify a header name as one of the well-known
+ *   ones. The name is hashed on its length and three
+ *   of its bytes, lowercased, which is enough to tell
+ *   all well-known names apart. Then it's compared
+ *   with the one name that has that hash.
+ *
+ * Returns:
+ *   The [xh_header_id] of the header or -1 if it's
+ *   not a well-known one.
+ */
+static int header_id(const char *name, int len)
+{
+	#define LOWER(c) ((unsigned char) (c) | 0x20)
+
+	if(len == 0)
+		return -1;
+
+	unsigned int hash = len * 3 
+	                  + LOWER(name[0])     * 13
+	                  + LOWER(name[len-1]) * 15 
+	                  + LOWER(name[len/2]) * 8;
+
+	int id = header_table[hash & 63] - 1;
+	if(id < 0 || header_names[id].len != len)
+		return -1;
+
+	for(int i = 0; i < len; i += 1)
+		if(LOWER(name[i]) != header_names[id].str[i])
+			return -1;
+
+	return id;
+
+	#undef LOWER
+}
 
-	// Duplicate name and value.
-	char *name2, *value2;
+/* Symbol: find_header
+ *
+ *   Finds the header from a header array.
+ *
+ * Arguments:
+ *
+ *   - headers: The header set array.
+ *
+ *   - name: The header's name, [len] bytes long. The 
+ *           comparison with each header's name isn't
+ *           case-sensitive, like [xh_header_cmp].
+ *
+ * Returns:
+ *   The index in the array of the matched header, or
+ *   -1 is no header was found.
+ */
+static int find_header(xh_table headers, const char *name, int len)
+{
+	for(int i = 0; i < headers.count; i += 1)
+		if(headers.list[i].key.len == len && !strncasecmp(name, headers.list[i].key.str, len))
+			return i;
+	return -1;
+}
+
+/* Symbol: header_add
+ *
+ *   Add or replace a header into a response object,
+ *   given its value already formatted. The name and
+ *   the value are copied into the response's arena
+ *   if [copy] is set, otherwise they're referenced
+ *   and must be zero-terminated.
+ */
+static void header_add(xh_response2 *res2, xh_string name, xh_string value, bool copy)
+{
+	if(res2->failed)
+		return;
+
+	unsigned int name_len  = name.len;
+	unsigned int value_len = value.len;
+
+	int id = header_id(name.str, name_len);
+	int i = (id < 0) ? find_header(res2->headers, name.str, name_len) 
+	                 : res2->header_slots[id] - 1;
+
+	char *name2  = name.str;
+	char *value2 = value.str;
+	if(copy)
 	{
-		void *mem = malloc(name_len + value_len + 2);
+		// Duplicate name and value.
+		void *mem = arena_alloc(res2->arena, name_len + value_len + 2);
 
 		if(mem == NULL)
 		{
@@ -317,8 +1244,10 @@ void xh_header_add(xh_response *res, const char *name, const char *valfmt, ...)
 		name2  = (char*) mem;
 		value2 = (char*) mem + name_len + 1;
 
-		strcpy(name2, name);
-		strcpy(value2, value);
+		memcpy(name2, name.str, name_len);
+		memcpy(value2, value.str, value_len);
+		name2[name_len] = '\0';
+		value2[value_len] = '\0';
 	}
 
 	if(i < 0)
@@ -328,14 +1257,14 @@ void xh_header_add(xh_response *res, const char *name, const char *valfmt, ...)
 				int new_capacity = res2->capacity == 0 
 				                 ? 8 : res2->capacity * 2;
 
-				void *tmp = realloc(res2->headers.list, 
-					            new_capacity * sizeof(xh_pair));
+				void *tmp = arena_realloc(res2->arena, res2->headers.list, 
+					                      res2->capacity * sizeof(xh_pair),
+					                      new_capacity * sizeof(xh_pair));
 
 				if(tmp == NULL)
 				{
 					// ERROR!
 					res2->failed = 1;
-					free(name2);
 					return;
 				}
 
@@ -348,19 +1277,160 @@ void xh_header_add(xh_response *res, const char *name, const char *valfmt, ...)
 		};
 		res2->headers.count += 1;
 		res2->public.headers = res2->headers;
+
+		if(id >= 0)
+			res2->header_slots[id] = res2->headers.count;
 	}
 	else
 	{
-		free(res2->headers.list[i].key.str);
 		res2->headers.list[i] = (xh_pair) {
 			{ name2, name_len }, { value2, value_len },
 		};
 	}
 }
 
-/* Symbol: xh_header_rem
+/* Symbol: xh_header_add
  *
- *   Remove a header from a response object.
+ *   Add or replace a header into a response object.
+ *
+ * Arguments:
+ *
+ *   - res: The response object.
+ *
+ *   - name: Zero-terminated string that contains
+ *           the header's name. The comparison with
+ *           each header's name is made using [xh_header_cmp],
+ *           so it's not case-sensitive.
+ *
+ *   - valfmt: A printf-like format string that evaluates
+ *             to the header's value.
+ *
+ * Returns:
+ *   Nothing. The header may or may not be added
+ *   (or replaced) to the request.
+ */
+void xh_header_add(xh_response *res, const char *name, const char *valfmt, ...)
+{
+	xh_response2 *res2 = (xh_response2*) ((char*) res - offsetof(xh_response2, public));
+
+	assert(&res2->public == res);
+
+	if(res2->failed)
+		return;
+
+	if(name == NULL)
+	{
+		res2->failed = 1;
+		return;
+	}
+
+	xh_string name2 = xh_string_new((char*) name, -1);
+
+	char *copy = arena_alloc(res2->arena, name2.len + 1);
+	if(copy == NULL)
+	{
+		// ERROR!
+		res2->failed = 1;
+		return;
+	}
+	memcpy(copy, name, name2.len + 1);
+	name2.str = copy;
+
+	// The value is formatted directly in the free
+	// space of the arena. It's only formatted again
+	// if it doesn't fit, knowing its length.
+	uint32_t space;
+	char *value = arena_peek(res2->arena, &space);
+
+	va_list args;
+	va_start(args, valfmt);
+	int n = vsnprintf(value, space, valfmt, args);
+	va_end(args);
+
+	if(n < 0)
+	{
+		// Bad format.
+		res2->failed = 1;
+		return;
+	}
+
+	if((unsigned int) n < space)
+	{
+		// Keep what was written.
+		value = arena_alloc(res2->arena, n + 1);
+		assert(value != NULL);
+	}
+	else
+	{
+		value = arena_alloc(res2->arena, n + 1);
+		if(value == NULL)
+		{
+			// ERROR!
+			res2->failed = 1;
+			return;
+		}
+
+		va_start(args, valfmt);
+		(void) vsnprintf(value, n + 1, valfmt, args);
+		va_end(args);
+	}
+
+	header_add(res2, name2, xh_string_new(value, n), 0);
+}
+
+/* Symbol: xh_header_add_string
+ *
+ *   Add or replace a header into a response object,
+ *   given its name and value as they are. Unlike 
+ *   [xh_header_add], the value isn't formatted and
+ *   there's no limit to its length.
+ *
+ * Arguments:
+ *
+ *   - res: The response object.
+ *
+ *   - name, value: The header's name and value. If
+ *                  their [len] is negative, they're
+ *                  zero-terminated.
+ *
+ *   - ownership: If [XH_COPY], the name and value 
+ *                are copied into the response. If
+ *                [XH_BORROW], they're used without
+ *                being copied, so they must be 
+ *                zero-terminated and stay valid
+ *                until the response is sent (like
+ *                string literals or memory from 
+ *                [xh_alloc]).
+ *
+ * Returns:
+ *   Nothing. The header may or may not be added
+ *   (or replaced) to the request.
+ */
+void xh_header_add_string(xh_response *res, xh_string name, xh_string value, 
+                          xh_ownership ownership)
+{
+	xh_response2 *res2 = (xh_response2*) ((char*) res - offsetof(xh_response2, public));
+
+	assert(&res2->public == res);
+
+	if(name.str == NULL || value.str == NULL)
+	{
+		res2->failed = 1;
+		return;
+	}
+
+	if(name.len < 0)
+		name.len = strlen(name.str);
+
+	if(value.len < 0)
+		value.len = strlen(value.str);
+
+	header_add(res2, name, value, ownership == XH_COPY);
+}
+
+/* Symbol: xh_header_rem
+ *
+ *   Remove a header from a response object.
  *
  * Arguments:
  *
@@ -384,15 +1454,24 @@ void xh_header_rem(xh_response *res, const char *name)
 	if(res2->failed)
 		return;
 
-	int i = find_header(res2->headers, name);
+	int len = name == NULL ? 0 : strlen(name);
+	int id  = header_id(name, len);
+	int i = (id < 0) ? find_header(res2->headers, name, len) 
+	                 : res2->header_slots[id] - 1;
 
 	if(i < 0)
 		return;
 
-	free(res2->headers.list[i].key.str);
-
 	assert(i >= 0);
 
+	// The headers that come after the removed
+	// one are moved back by one position.
+	for(int k = 0; k < XH_HDR_COUNT; k += 1)
+		if(res2->header_slots[k] > i + 1)
+			res2->header_slots[k] -= 1;
+	if(id >= 0)
+		res2->header_slots[id] = 0;
+
 	for(; i < res2->headers.count-1; i += 1)
 		res2->headers.list[i] = res2->headers.list[i+1];
 
@@ -400,7 +1479,47 @@ void xh_header_rem(xh_response *res, const char *name)
 	res2->public.headers = res2->headers;
 }
 
-static xh_table get_headers_from_req_or_res(void *req_or_res)
+/* Symbol: xh_alloc
+ *
+ *   Allocate memory that stays valid until the
+ *   response is sent. It doesn't need to be freed.
+ *   This is useful to build response bodies and 
+ *   header values without having to manage their
+ *   lifetime.
+ *
+ * Arguments:
+ *
+ *   - res: The response object.
+ *
+ *   - size: Number of bytes to allocate.
+ *
+ * Returns:
+ *   The allocated memory (aligned to 16 bytes) or 
+ *   NULL if there's no memory.
+ *
+ * Notes:
+ *   - The memory must not be used as a body with a
+ *     [release] function, since it's not owned by
+ *     the caller.
+ */
+void *xh_alloc(xh_response *res, size_t size)
+{
+	xh_response2 *res2 = (xh_response2*) ((char*) res - offsetof(xh_response2, public));
+
+	assert(&res2->public == res);
+
+	return arena_alloc(res2->arena, size);
+}
+
+/* Symbol: get_headers_from_req_or_res
+ *
+ *   Get the header table of a request or response
+ *   object and its [header_slots]. The slots of a
+ *   response are only valid if its table is the one
+ *   built with [xh_header_add], otherwise [slots] is
+ *   set to NULL.
+ */
+static xh_table get_headers_from_req_or_res(void *req_or_res, const int **slots)
 {
 	_Static_assert(offsetof(xh_response2, public) == offsetof(xh_request2, public), 
 					   "The public portion of xh_response2 and xh_request2 must be aligned the same way");
@@ -410,9 +1529,19 @@ static xh_table get_headers_from_req_or_res(void *req_or_res)
 
 	assert(type == XH_RES || type == XH_REQ);
 
-	xh_table headers = (type == XH_REQ)?
-			((xh_request *) req_or_res)->headers:
-			((xh_response*) req_or_res)->headers;
+	if(type == XH_REQ)
+	{
+		xh_request2 *req2 = (xh_request2*) ((char*) req_or_res - offsetof(xh_request2, public));
+		*slots = req2->header_slots;
+		return req2->public.headers;
+	}
+
+	xh_response2 *res2 = (xh_response2*) ((char*) req_or_res - offsetof(xh_response2, public));
+	xh_table headers = res2->public.headers;
+	if(headers.list == res2->headers.list && headers.count == res2->headers.count)
+		*slots = res2->header_slots;
+	else
+		*slots = NULL;
 	return headers;
 }
 
@@ -444,9 +1573,48 @@ static xh_table get_headers_from_req_or_res(void *req_or_res)
  */
 const char *xh_header_get(void *req_or_res, const char *name)
 {
-	xh_table headers = get_headers_from_req_or_res(req_or_res);
+	int len = name == NULL ? 0 : strlen(name);
+	int id  = header_id(name, len);
+	if(id >= 0)
+		return xh_header_get_id(req_or_res, id);
+
+	const int *slots;
+	xh_table headers = get_headers_from_req_or_res(req_or_res, &slots);
+
+	int i = find_header(headers, name, len);
+
+	if(i < 0)
+		return NULL;
+
+	return headers.list[i].val.str;
+}
+
+/* Symbol: xh_header_get_id
+ *
+ *   Like [xh_header_get], but the header is
+ *   identified by an [xh_header_id]. The lookup
+ *   takes constant time, since the position of
+ *   the well-known headers is recorded when the
+ *   request is parsed or the header is added.
+ *
+ * Returns:
+ *   A zero-terminated string containing the value of
+ *   the header or NULL if the header isn't contained
+ *   in the request/response.
+ */
+const char *xh_header_get_id(void *req_or_res, xh_header_id id)
+{
+	if((int) id < 0 || id >= XH_HDR_COUNT)
+		return NULL;
+
+	const int *slots;
+	xh_table headers = get_headers_from_req_or_res(req_or_res, &slots);
 
-	int i = find_header(headers, name);
+	int i;
+	if(slots != NULL)
+		i = slots[id] - 1;
+	else
+		i = find_header(headers, header_names[id].str, header_names[id].len);
 
 	if(i < 0)
 		return NULL;
@@ -481,29 +1649,29 @@ bool xh_header_cmp(const char *a, const char *b)
 	return tolower(*a) == tolower(*b);
 }
 
-static void res_init(xh_response2 *res)
+static void res_init(xh_response2 *res, arena_t *arena)
 {
 	memset(res, 0, sizeof(xh_response2));
 	res->type = XH_RES;
+	res->arena = arena;
 	res->public.body.len = -1;
 }
 
-static void res_deinit(xh_response2 *res)
-{
-	if(res->headers.list != NULL)
-	{
-		assert(res->headers.count > 0);
-		for(int i = 0; i < res->headers.count; i += 1)
-			free(res->headers.list[i].key.str);
-		free(res->headers.list);
-		res->headers.list = NULL;
-	}
-}
-
 static void res_reinit(xh_response2 *res)
 {
-	res_deinit(res);
-	res_init(res);
+	// The response is being thrown away, so if
+	// the callback handed over the body, it must
+	// be released here. The headers are in the
+	// arena, so they don't need to be freed.
+	if(res->public.release != NULL && res->public.body.str != NULL)
+		res->public.release(res->public.body.str);
+
+	if(res->public.producer != NULL)
+		res->public.producer(NULL, 0, res->public.producer_userp);
+
+	xh_token token = res->token;
+	res_init(res, res->arena);
+	res->token = token;
 }
 
 static void req_init(xh_request2 *req)
@@ -513,705 +1681,3315 @@ static void req_init(xh_request2 *req)
 
 static void req_deinit(xh_request *req)
 {
-	free(req->headers.list);
+	// The header list is allocated in 
+	// the connection's arena.
 	req->headers.list = NULL;
 	req->headers.count = 0;
 }
 
-static bool set_non_blocking(int fd)
+static void stat_add(atomic_ullong *counter, unsigned long long n)
 {
-	int flags = fcntl(fd, F_GETFL);
-
-	if(flags < 0)
-		return 0;
-
-	return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+	// Since there's only one writer, there's no need
+	// for an atomic read-modify-write.
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, 
+	                      memory_order_relaxed);
 }
 
-static void accept_connection(context_t *ctx)
+static uint64_t current_time_ms(void)
 {
-	int cfd = accept(ctx->fd, NULL, NULL);
-
-	if(cfd < 0)
-		return; // Failed to accept.
-
-	if(!set_non_blocking(cfd))
-	{
-		(void) close(cfd);
-		return;
-	}
+	struct timespec ts;
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	if(ctx->freelist == NULL)
-	{
-		// Connection limit reached.
-		(void) close(cfd);
+static void timer_disarm(context_t *ctx, conn_t *conn)
+{
+	if(conn->timer_kind == TIMER_NONE)
 		return;
-	}
 
-	conn_t *conn = ctx->freelist;
-	ctx->freelist = conn->next;
+	if(conn->timer_prev)
+		conn->timer_prev->timer_next = conn->timer_next;
+	else
+		ctx->timers.slots[conn->deadline % TIMER_SLOTS] = conn->timer_next;
 
-	assert(((intptr_t) conn & 
-		    (intptr_t) 1) == 0);
+	if(conn->timer_next)
+		conn->timer_next->timer_prev = conn->timer_prev;
 
-	memset(conn, 0, sizeof(conn_t));
-	conn->fd = cfd;
-	req_init(&conn->request);
+	conn->timer_prev = NULL;
+	conn->timer_next = NULL;
+	conn->timer_kind = TIMER_NONE;
+	ctx->timers.armed -= 1;
+}
 
-	struct epoll_event buffer;
-	buffer.events = EPOLLET  | EPOLLIN
-	              | EPOLLPRI | EPOLLOUT
-	              | EPOLLRDHUP;
-	buffer.data.ptr = conn;
-	if(epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, cfd, &buffer))
-	{
-		(void) close(cfd);
+/* Symbol: timer_arm
+ *
+ *   Schedule the connection to be closed in [seconds]
+ *   seconds, replacing any timer it already had. If
+ *   [seconds] is 0, the connection is left without a
+ *   timer.
+ */
+static void timer_arm(context_t *ctx, conn_t *conn, timer_kind_t kind, unsigned int seconds)
+{
+	timer_disarm(ctx, conn);
 
-		conn->fd = -1;
-		conn->next = ctx->freelist;
-		ctx->freelist = conn;
+	if(seconds == 0)
 		return;
-	}
 
-	ctx->connum += 1;
+	// Round up to the next tick so that the
+	// connection never times out early.
+	uint64_t now = current_time_ms() / TIMER_TICK_MS;
+	uint64_t deadline = now + ((uint64_t) seconds * 1000 + TIMER_TICK_MS - 1) / TIMER_TICK_MS + 1;
+
+	conn_t **slot = &ctx->timers.slots[deadline % TIMER_SLOTS];
+
+	conn->deadline = deadline;
+	conn->timer_kind = kind;
+	conn->timer_prev = NULL;
+	conn->timer_next = *slot;
+	if(*slot)
+		(*slot)->timer_prev = conn;
+	*slot = conn;
+	ctx->timers.armed += 1;
 }
 
-static void close_connection(context_t *ctx, conn_t *conn)
+static void ready_push(context_t *ctx, conn_t *conn)
 {
-	(void) close(conn->fd);
-
-	if(conn->in.data != NULL)
-	{
-		free(conn->in.data);
-		conn->in.data = NULL;
-	}
+	if(conn->ready)
+		return;
 
-	if(conn->out.data != NULL)
-	{
-		free(conn->out.data);
-		conn->out.data = NULL;
-	}
+	conn->ready = 1;
+	conn->ready_next = NULL;
+	conn->ready_prev = ctx->ready_tail;
+	if(ctx->ready_tail != NULL)
+		ctx->ready_tail->ready_next = conn;
+	else
+		ctx->ready_head = conn;
+	ctx->ready_tail = conn;
+}
 
-	if(conn->request.public.headers.list != NULL)
-		free(conn->request.public.headers.list);
+static void ready_remove(context_t *ctx, conn_t *conn)
+{
+	if(!conn->ready)
+		return;
 
-	conn->fd = -1;
+	if(conn->ready_prev != NULL)
+		conn->ready_prev->ready_next = conn->ready_next;
+	else
+		ctx->ready_head = conn->ready_next;
 
-	conn->next = ctx->freelist;
-	ctx->freelist = conn;
+	if(conn->ready_next != NULL)
+		conn->ready_next->ready_prev = conn->ready_prev;
+	else
+		ctx->ready_tail = conn->ready_prev;
 
-	ctx->connum -= 1;
+	conn->ready = 0;
+	conn->ready_prev = NULL;
+	conn->ready_next = NULL;
 }
 
-#if DEBUG
-static void close_connection_(context_t *ctx, conn_t *conn, const char *file, int line)
+/* Symbol: file_cache_init
+ *
+ *   Set up a cache of up to [capacity] files (0 
+ *   disables it). Entries expire after [ttl] seconds
+ *   if it's not 0.
+ *
+ * Returns:
+ *   1 on success, 0 if there's no memory.
+ */
+static bool file_cache_init(file_cache_t *cache, uint32_t capacity, uint32_t ttl)
 {
-	fprintf(stderr, "Closing connection at %s:%d.\n", file, line);
-	close_connection(ctx, conn);
-}
-#define close_connection(ctx, conn) close_connection_(ctx, conn, __FILE__, __LINE__)
-#endif
+	memset(cache, 0, sizeof(file_cache_t));
+	cache->inotify = -1;
+	cache->ttl = ttl;
 
-static bool is_uppercase_alpha(char c)
-{
-	return c >= 'A' && c <= 'Z';
-}
+	if(capacity == 0)
+		return 1;
 
-static bool is_digit(char c)
-{
-	return c >= '0' && c <= '9';
-}
+	uint32_t size = 1;
+	while(size < 2 * capacity)
+		size <<= 1;
 
-static bool is_space(char c)
-{
-	return c == ' ';
+	cache->by_path = calloc(size, sizeof(file_entry_t*));
+	cache->by_wd   = calloc(size, sizeof(file_entry_t*));
+	if(cache->by_path == NULL || cache->by_wd == NULL)
+	{
+		free(cache->by_path);
+		free(cache->by_wd);
+		return 0;
+	}
+	cache->mask = size - 1;
+	cache->capacity = capacity;
+
+	// If inotify isn't available, the entries
+	// are reopened periodically.
+	cache->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	return 1;
 }
 
-static void skip(char *str, uint32_t len, uint32_t *i, bool not, bool (*test)(char))
+static uint32_t hash_path(const char *path)
 {
-	if(not)
-		while(*i < len && !test(str[*i]))
-			*i += 1;
-	else
-		while(*i < len && test(str[*i]))
-			*i += 1;
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for(int i = 0; path[i] != '\0'; i += 1)
+		hash = (hash ^ (unsigned char) path[i]) * 16777619u;
+	return hash;
 }
 
-static void skip_until(char *str, uint32_t len, uint32_t *i, char c)
+/* Symbol: file_cache_unwatch
+ *
+ *   Remove an inotify watch unless a cached entry
+ *   still uses it. More than one entry can share
+ *   a watch when the same file is cached under
+ *   different paths.
+ */
+static void file_cache_unwatch(file_cache_t *cache, int wd)
 {
-	while(*i < len && str[*i] != c)
-		*i += 1;
+	for(file_entry_t *e = cache->by_wd[wd & cache->mask]; e != NULL; e = e->wd_next)
+		if(e->wd == wd)
+			return;
+	(void) inotify_rm_watch(cache->inotify, wd);
 }
 
-struct parse_err_t {
-	bool   internal;
-	char        *msg;
-	unsigned int len;
-};
-
-static struct parse_err_t parse(char *str, uint32_t len, xh_request *req)
+/* Symbol: file_cache_remove
+ *
+ *   Remove an entry from the cache. It's freed once
+ *   no response is using it.
+ */
+static void file_cache_remove(file_cache_t *cache, file_entry_t *entry)
 {
-	#define OK \
-		((struct parse_err_t) { .internal = 0, .msg = NULL})
+	assert(entry->cached);
 
-	#define FAILURE(msg_) \
-		((struct parse_err_t) { .internal = 0, .msg = msg_, .len = sizeof(msg_)-1 })
+	file_entry_t **link = &cache->by_path[entry->hash & cache->mask];
+	while(*link != entry)
+		link = &(*link)->path_next;
+	*link = entry->path_next;
 
-	#define INTERNAL_FAILURE(msg_) \
-		((struct parse_err_t) { .internal = 1, .msg = msg_, .len = sizeof(msg_)-1 })
+	if(entry->wd >= 0)
+	{
+		link = &cache->by_wd[entry->wd & cache->mask];
+		while(*link != entry)
+			link = &(*link)->wd_next;
+		*link = entry->wd_next;
 
-	if(len == 0)
-		return FAILURE("Empty request");
+		file_cache_unwatch(cache, entry->wd);
+	}
 
-	uint32_t i = 0;
+	if(entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
 
-	uint32_t method_offset = i;
+	if(entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
 
-	skip(str, len, &i, 0, is_uppercase_alpha);
+	cache->count -= 1;
+	entry->cached = 0;
 
-	uint32_t method_length = i - method_offset;
+	if(entry->refs == 0)
+	{
+		(void) close(entry->fd);
+		free(entry);
+	}
+}
 
-	if(method_length == 0)
-		return FAILURE("Missing method");
+static void file_cache_free(file_cache_t *cache)
+{
+	while(cache->head != NULL)
+		file_cache_remove(cache, cache->head);
 
-	if(i == len)
-		return FAILURE("Missing URL and HTTP version");
+	free(cache->by_path);
+	free(cache->by_wd);
 
-	if(!is_space(str[i]))
-		return FAILURE("Bad character after method. Methods can only have uppercase alphabetic characters");
+	if(cache->inotify >= 0)
+		(void) close(cache->inotify);
+}
 
-	skip(str, len, &i, 0, is_space);
+static void file_cache_release(file_cache_t *cache, file_entry_t *entry)
+{
+	(void) cache;
 
-	if(i == len)
-		return FAILURE("Missing URL and HTTP version");
+	assert(entry->refs > 0);
+	entry->refs -= 1;
 
-	uint32_t URL_offset = i;
-	while(i < len && str[i] != ' ' && str[i] != '?')
-		i += 1;
-	uint32_t URL_length = i - URL_offset;
-	
-	uint32_t params_offset;
-	if(i < len && str[i] == '?')
+	if(entry->refs == 0 && !entry->cached)
 	{
-		params_offset = i+1;
-		while(i < len && str[i] != ' ')
-			i += 1;
+		(void) close(entry->fd);
+		free(entry);
 	}
-	else params_offset = i;
-	uint32_t params_length = i - params_offset;
-
-	if(i == len)
-		return FAILURE("Missing HTTP version");
+}
 
-	assert(is_space(str[i]));
+/* Symbol: file_cache_lookup
+ *
+ *   Find the entry of a path and mark it as the
+ *   most recently used one.
+ *
+ * Returns:
+ *   The entry or NULL if it's not cached.
+ */
+static file_entry_t *file_cache_lookup(file_cache_t *cache, const char *path)
+{
+	uint32_t hash = hash_path(path);
+
+	file_entry_t *entry = cache->by_path[hash & cache->mask];
+	while(entry != NULL && (entry->hash != hash || strcmp(entry->path, path)))
+		entry = entry->path_next;
+
+	if(entry == NULL)
+		return NULL;
+
+	if(entry->expire > 0 && current_time_ms() >= entry->expire)
+	{
+		file_cache_remove(cache, entry);
+		return NULL;
+	}
+
+	if(entry != cache->head)
+	{
+		entry->prev->next = entry->next;
+		if(entry->next != NULL)
+			entry->next->prev = entry->prev;
+		else
+			cache->tail = entry->prev;
+
+		entry->prev = NULL;
+		entry->next = cache->head;
+		cache->head->prev = entry;
+		cache->head = entry;
+	}
+	return entry;
+}
+
+/* Symbol: file_cache_insert
+ *
+ *   Add an open file to the cache. It may go one
+ *   entry over capacity, in which case the caller
+ *   evicts one. [wd] is the inotify watch of the
+ *   file or -1.
+ *
+ * Returns:
+ *   The new entry or NULL if there's no memory.
+ */
+static file_entry_t *file_cache_insert(file_cache_t *cache, const char *path, 
+                                       int fd, int wd, const struct stat *info)
+{
+	size_t len = strlen(path);
+
+	file_entry_t *entry = malloc(sizeof(file_entry_t) + len + 1);
+	if(entry == NULL)
+		return NULL;
+
+	assert(cache->count <= cache->capacity);
+
+	entry->path = (char*) (entry + 1);
+	memcpy(entry->path, path, len + 1);
+	entry->hash = hash_path(path);
+	entry->fd = fd;
+	entry->wd = wd;
+	entry->info = *info;
+	entry->refs = 0;
+	entry->cached = 1;
+
+	// Files that aren't watched are reopened 
+	// every second, unless a TTL was given.
+	uint32_t ttl = cache->ttl;
+	if(wd < 0 && ttl == 0)
+		ttl = 1;
+	entry->expire = ttl > 0 ? current_time_ms() + 1000 * (uint64_t) ttl : 0;
+
+	entry->path_next = cache->by_path[entry->hash & cache->mask];
+	cache->by_path[entry->hash & cache->mask] = entry;
+
+	if(wd >= 0)
+	{
+		entry->wd_next = cache->by_wd[wd & cache->mask];
+		cache->by_wd[wd & cache->mask] = entry;
+	}
+	else
+		entry->wd_next = NULL;
+
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if(cache->head != NULL)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+	cache->head = entry;
+
+	cache->count += 1;
+	return entry;
+}
+
+/* Symbol: file_cache_handle_events
+ *
+ *   Read the events reported by inotify and remove
+ *   the entries of the files that changed.
+ */
+static void file_cache_handle_events(file_cache_t *cache)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while(1)
+	{
+		ssize_t n = read(cache->inotify, buffer, sizeof(buffer));
+
+		if(n <= 0)
+			// Either there are no more events (EAGAIN) or 
+			// an error occurred. In both cases, there's 
+			// nothing else to do.
+			break;
+
+		for(ssize_t i = 0; i < n; )
+		{
+			struct inotify_event *event = (struct inotify_event*) (buffer + i);
+			i += sizeof(struct inotify_event) + event->len;
+
+			if(event->mask & IN_Q_OVERFLOW)
+			{
+				// Events were lost, so any file 
+				// may have changed.
+				while(cache->head != NULL)
+					file_cache_remove(cache, cache->head);
+				continue;
+			}
+
+			file_entry_t *entry = cache->by_wd[event->wd & cache->mask];
+			while(entry != NULL)
+			{
+				file_entry_t *next = entry->wd_next;
+				if(entry->wd == event->wd)
+					file_cache_remove(cache, entry);
+				entry = next;
+			}
+		}
+	}
+}
+
+// Events connection sockets are always monitored for.
+#define CONN_EVENTS (EPOLLET | EPOLLIN | EPOLLPRI | EPOLLRDHUP)
+
+/* Symbol: rewatch
+ *
+ *   Change the events a connection's socket is 
+ *   monitored for.
+ *
+ * Returns:
+ *   1 on success, 0 on failure.
+ */
+static bool rewatch(context_t *ctx, conn_t *conn, uint32_t events)
+{
+	if(conn->events == events)
+		return 1;
+	conn->events = events;
+
+	struct epoll_event buffer;
+	buffer.events = events;
+	buffer.data.ptr = conn;
+	return !epoll_ctl(ctx->epfd, EPOLL_CTL_MOD, conn->fd, &buffer);
+}
+
+static void add_connection(context_t *ctx, int cfd)
+{
+	if(ctx->freelist == NULL)
+	{
+		// Connection limit reached.
+		(void) close(cfd);
+		return;
+	}
+
+	conn_t *conn = ctx->freelist;
+	ctx->freelist = conn->next;
+
+	assert(((intptr_t) conn & 
+		    (intptr_t) 1) == 0);
+
+	uint32_t gen = conn->gen;
+	memset(conn, 0, sizeof(conn_t));
+	conn->gen = gen;
+	conn->fd = cfd;
+	conn->arena.pool = &ctx->buffers;
+	req_init(&conn->request);
+
+	// Writability isn't monitored until a 
+	// response doesn't fit in the socket's 
+	// buffer.
+	conn->events = CONN_EVENTS;
+
+	struct epoll_event buffer;
+	buffer.events = conn->events;
+	buffer.data.ptr = conn;
+	if(epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, cfd, &buffer))
+	{
+		(void) close(cfd);
+
+		conn->fd = -1;
+		conn->next = ctx->freelist;
+		ctx->freelist = conn;
+		return;
+	}
+
+	// The client has [header_timeout] seconds
+	// to send the head of the first request.
+	timer_arm(ctx, conn, TIMER_HEADER, ctx->header_timeout);
+
+	ctx->connum += 1;
+	stat_add(&ctx->stats.connections, 1);
+}
+
+/* Symbol: accept_connection
+ *
+ *   Accept the connections waiting in the listener's
+ *   queue until it's empty or [accept_budget] of them
+ *   were accepted. The listener is level-triggered, so
+ *   if the budget runs out the remaining connections
+ *   are reported again by the next wait, after the
+ *   other events were handled.
+ */
+static void accept_connection(context_t *ctx)
+{
+	for(unsigned int i = 0; i < ctx->accept_budget; i += 1)
+	{
+		int cfd = accept4(ctx->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if(cfd < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// Either the queue is empty or an error
+			// occurred (for example the process ran
+			// out of file descriptors). Either way,
+			// stop here.
+			break;
+		}
+
+		add_connection(ctx, cfd);
+	}
+}
+
+static void rebase_string(xh_string *str, const char *old_base, char *new_base)
+{
+	if(str->str != NULL)
+		str->str = new_base + ((uintptr_t) str->str - (uintptr_t) old_base);
+}
+
+/* Symbol: rebase_request
+ *
+ *   Update the pointers of a parsed request after the
+ *   contents of the input buffer were moved from 
+ *   [old_base] to [new_base].
+ */
+static void rebase_request(xh_request *req, const char *old_base, char *new_base)
+{
+	rebase_string(&req->method, old_base, new_base);
+	rebase_string(&req->URL,    old_base, new_base);
+	rebase_string(&req->params, old_base, new_base);
+
+	for(int i = 0; i < req->capture_count; i += 1)
+		rebase_string(&req->captures[i], old_base, new_base);
+
+	for(int i = 0; i < req->headers.count; i += 1)
+	{
+		rebase_string(&req->headers.list[i].key, old_base, new_base);
+		rebase_string(&req->headers.list[i].val, old_base, new_base);
+	}
+}
+
+static void release_body(conn_t *conn)
+{
+	if(conn->res_body.str != NULL)
+	{
+		if(conn->res_body_release != NULL)
+			conn->res_body_release(conn->res_body.str);
+		conn->res_body.str = NULL;
+		conn->res_body_release = NULL;
+	}
+}
+
+static void stop_producer(conn_t *conn)
+{
+	if(conn->producer != NULL)
+	{
+		conn->producer(NULL, 0, conn->producer_userp);
+		conn->producer = NULL;
+	}
+}
+
+/* Symbol: close_file
+ *
+ *   Close a file that was opened with [open_file].
+ */
+static void close_file(context_t *ctx, int fd, file_entry_t *entry)
+{
+	if(entry != NULL)
+		file_cache_release(&ctx->files, entry);
+	else
+		(void) close(fd);
+}
+
+static void close_connection(context_t *ctx, conn_t *conn)
+{
+	timer_disarm(ctx, conn);
+	ready_remove(ctx, conn);
+	(void) close(conn->fd);
+
+	pool_put(&ctx->buffers, conn->in.data, conn->in.size);
+	pool_put(&ctx->buffers, conn->out.data, conn->out.size);
+	conn->in.data = NULL;
+	conn->out.data = NULL;
+
+	arena_free(&conn->arena);
+
+	if(conn->sending_from_fd)
+	{
+		close_file(ctx, conn->file_fd, conn->file_entry);
+		conn->sending_from_fd = 0;
+	}
+
+	free(conn->parts);
+	conn->parts = NULL;
+
+	release_body(conn);
+	stop_producer(conn);
+
+	conn->fd = -1;
+	conn->gen += 1;
+
+	conn->next = ctx->freelist;
+	ctx->freelist = conn;
+
+	ctx->connum -= 1;
+}
+
+#if DEBUG
+static void close_connection_(context_t *ctx, conn_t *conn, const char *file, int line)
+{
+	fprintf(stderr, "Closing connection at %s:%d.\n", file, line);
+	close_connection(ctx, conn);
+}
+#define close_connection(ctx, conn) close_connection_(ctx, conn, __FILE__, __LINE__)
+#endif
+
+static bool is_uppercase_alpha(char c)
+{
+	return c >= 'A' && c <= 'Z';
+}
+
+static bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static bool is_space(char c)
+{
+	return c == ' ';
+}
+
+static bool is_hex_digit(char c)
+{
+	return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/*                                                                                                *
+ * +--------------------------------------------------------------------------------------------+ *
+ * |                                                                                            | *
+ * |                                        SCANNING KERNELS                                    | *
+ * |                                                                                            | *
+ * | The hot loops of the parser (scanning the URL, header names and header values) are         | *
+ * | implemented by the following kernels. Each one has a scalar version and, on x86-64, an     | *
+ * | SSE2 and an AVX2 version that look at 16 or 32 bytes at the time. The best version         | *
+ * | supported by the CPU is chosen once at start-up by [select_scanner] and called through     | *
+ * | the [scanner] table.                                                                       | *
+ * |                                                                                            | *
+ * | - [scan_token] returns the offset of the first byte that isn't a token character, as       | *
+ * |   defined by RFC 7230 (which is the set of characters allowed in header names)             | *
+ * |                                                                                            | *
+ * | - [scan_text] returns the offset of the first control character other than HTAB, or of     | *
+ * |   the first occurrence of [stop1] or [stop2]                                               | *
+ * |                                                                                            | *
+ * | When nothing is found, [scan_token] and [scan_text] return the length of the string.       | *
+ * |                                                                                            | *
+ * +--------------------------------------------------------------------------------------------+ *
+ *                                                                                                */
+
+static bool is_token_char(char c)
+{
+	static const bool table[128] = {
+		['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+		['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, 
+		['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, 
+		['`'] = 1, ['|'] = 1, ['~'] = 1,
+	};
+	return (unsigned char) c < 128 && table[(unsigned char) c];
+}
+
+static bool is_text_char(char c)
+{
+	return ((unsigned char) c >= 0x20 && c != 0x7f) || c == '\t';
+}
+
+static uint32_t scan_token_scalar(const char *str, uint32_t len)
+{
+	uint32_t i = 0;
+	while(i < len && is_token_char(str[i]))
+		i += 1;
+	return i;
+}
+
+static uint32_t scan_text_scalar(const char *str, uint32_t len, char stop1, char stop2)
+{
+	uint32_t i = 0;
+	while(i < len && is_text_char(str[i]) && str[i] != stop1 && str[i] != stop2)
+		i += 1;
+	return i;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* The vector versions of [scan_token] only look for
+ * bytes other than alphanumerics and '-', which make
+ * up nearly all header names. When one is found, it's
+ * checked with the scalar table and the scan resumes
+ * after it if it's a token character.
+ */
+
+static __m128i in_range_sse2(__m128i v, char lo, char hi)
+{
+	// Bytes over 0x7F are negative, so they're 
+	// never in any range.
+	return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+	                     _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static uint32_t scan_token_sse2(const char *str, uint32_t len)
+{
+	uint32_t i = 0;
+	while(i + 16 <= len)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*) (str + i));
+		__m128i ok = _mm_or_si128(_mm_or_si128(in_range_sse2(v, 'a', 'z'), 
+		                                       in_range_sse2(v, 'A', 'Z')),
+		                          _mm_or_si128(in_range_sse2(v, '0', '9'),
+		                                       _mm_cmpeq_epi8(v, _mm_set1_epi8('-'))));
+		unsigned int mask = ~_mm_movemask_epi8(ok) & 0xFFFF;
+
+		if(mask == 0)
+		{
+			i += 16;
+			continue;
+		}
+
+		i += __builtin_ctz(mask);
+		if(!is_token_char(str[i]))
+			return i;
+		i += 1;
+	}
+	return i + scan_token_scalar(str + i, len - i);
+}
+
+static uint32_t scan_text_sse2(const char *str, uint32_t len, char stop1, char stop2)
+{
+	uint32_t i = 0;
+	while(i + 16 <= len)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*) (str + i));
+
+		// Control characters are the bytes in [0, 0x1F]
+		// and 0x7F. Bytes over 0x7F are negative, so 
+		// they're excluded by the first comparison.
+		__m128i ctl = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(-1)),
+		                            _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)));
+		ctl = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), ctl);
+		ctl = _mm_or_si128(ctl, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+
+		__m128i stop = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(stop1)),
+		                            _mm_cmpeq_epi8(v, _mm_set1_epi8(stop2)));
+
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(ctl, stop));
+		if(mask != 0)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+	return i + scan_text_scalar(str + i, len - i, stop1, stop2);
+}
+
+__attribute__((target("avx2")))
+static __m256i in_range_avx2(__m256i v, char lo, char hi)
+{
+	return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+	                        _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_token_avx2(const char *str, uint32_t len)
+{
+	uint32_t i = 0;
+	while(i + 32 <= len)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*) (str + i));
+		__m256i ok = _mm256_or_si256(_mm256_or_si256(in_range_avx2(v, 'a', 'z'), 
+		                                             in_range_avx2(v, 'A', 'Z')),
+		                             _mm256_or_si256(in_range_avx2(v, '0', '9'),
+		                                             _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-'))));
+		unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(ok);
+
+		if(mask == 0)
+		{
+			i += 32;
+			continue;
+		}
+
+		i += __builtin_ctz(mask);
+		if(!is_token_char(str[i]))
+			return i;
+		i += 1;
+	}
+	return i + scan_token_sse2(str + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_text_avx2(const char *str, uint32_t len, char stop1, char stop2)
+{
+	uint32_t i = 0;
+	while(i + 32 <= len)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*) (str + i));
+
+		__m256i ctl = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(-1)),
+		                               _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v));
+		ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')), ctl);
+		ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+
+		__m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(stop1)),
+		                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8(stop2)));
+
+		unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(ctl, stop));
+		if(mask != 0)
+			return i + __builtin_ctz(mask);
+		i += 32;
+	}
+	return i + scan_text_sse2(str + i, len - i, stop1, stop2);
+}
+#endif /* __x86_64__ */
+
+static struct {
+	uint32_t (*scan_token)(const char *str, uint32_t len);
+	uint32_t (*scan_text)(const char *str, uint32_t len, char stop1, char stop2);
+} scanner = {
+	scan_token_scalar,
+	scan_text_scalar,
+};
+
+static void select_scanner_once(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		scanner.scan_token = scan_token_avx2;
+		scanner.scan_text = scan_text_avx2;
+	}
+	else
+	{
+		// SSE2 is part of the x86-64 baseline.
+		scanner.scan_token = scan_token_sse2;
+		scanner.scan_text = scan_text_sse2;
+	}
+#endif
+}
+
+/* Symbol: select_scanner
+ *
+ *   Choose the kernels for the running CPU. This is 
+ *   the only global state of the library, and since
+ *   it only depends on the CPU, it's initialized once
+ *   per process.
+ */
+static void select_scanner(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, select_scanner_once);
+}
+
+struct parse_err_t {
+	bool   internal;
+	char        *msg;
+	unsigned int len;
+};
+
+/* Symbol: parse
+ *
+ *   Parse the head of a request incrementally. The 
+ *   bytes from the parser's position to [len] are
+ *   consumed and the position is saved in [p], so that
+ *   every byte is only scanned once no matter how the
+ *   head is fragmented.
+ *
+ *   When the head is complete, the state of the parser 
+ *   becomes [PARSE_DONE] and [req] is filled in. If the
+ *   head isn't complete yet, OK is returned with any
+ *   other state.
+ *
+ * Arguments:
+ *
+ *   - str: The start of the request. The memory may 
+ *          change between calls as long as the bytes
+ *          before [len] stay the same.
+ *
+ *   - len: The number of bytes of the request that
+ *          were received until now.
+ */
+static struct parse_err_t parse(parser_t *p, char *str, uint32_t len, xh_request2 *req2, arena_t *arena)
+{
+	xh_request *req = &req2->public;
+
+	#define OK \
+		((struct parse_err_t) { .internal = 0, .msg = NULL})
+
+	#define FAILURE(msg_) \
+		((struct parse_err_t) { .internal = 0, .msg = msg_, .len = sizeof(msg_)-1 })
+
+	#define INTERNAL_FAILURE(msg_) \
+		((struct parse_err_t) { .internal = 1, .msg = msg_, .len = sizeof(msg_)-1 })
+
+	// Save the position and wait for more data
+	// if the end of the received bytes is reached.
+	#define NEED_MORE() \
+		{ p->cur = i; return OK; }
+
+	uint32_t i = p->cur;
+
+	while(p->state != PARSE_DONE)
+	{
+		switch(p->state)
+		{
+			case PARSE_METHOD:
+			while(i < len && is_uppercase_alpha(str[i]))
+				i += 1;
+
+			if(i == len)
+				NEED_MORE();
+
+			p->method_offset = 0;
+			p->method_length = i;
+
+			if(p->method_length == 0)
+				return FAILURE("Missing method");
+
+			if(str[i] == '\r')
+				return FAILURE("Missing URL and HTTP version");
+
+			if(!is_space(str[i]))
+				return FAILURE("Bad character after method. Methods can only have uppercase alphabetic characters");
+
+			p->state = PARSE_SPACE_AFTER_METHOD;
+			break;
+
+			case PARSE_SPACE_AFTER_METHOD:
+			while(i < len && is_space(str[i]))
+				i += 1;
+
+			if(i == len)
+				NEED_MORE();
+
+			if(str[i] == '\r')
+				return FAILURE("Missing URL and HTTP version");
+
+			p->URL_offset = i;
+			p->state = PARSE_URL;
+			break;
+
+			case PARSE_URL:
+			i += scanner.scan_text(str + i, len - i, ' ', '?');
+
+			if(i == len)
+				NEED_MORE();
+
+			p->URL_length = i - p->URL_offset;
+
+			if(str[i] == '?')
+			{
+				i += 1; // Skip the '?'.
+				p->params_offset = i;
+				p->state = PARSE_PARAMS;
+				break;
+			}
+
+			p->params_offset = i;
+			p->params_length = 0;
+			goto after_URL;
+
+			case PARSE_PARAMS:
+			i += scanner.scan_text(str + i, len - i, ' ', ' ');
+
+			if(i == len)
+				NEED_MORE();
+
+			p->params_length = i - p->params_offset;
+
+		after_URL:
+			if(str[i] == '\r')
+				return FAILURE("Missing HTTP version");
+
+			if(str[i] != ' ')
+				return FAILURE("Bad character in URL");
+
+			p->state = PARSE_SPACE_AFTER_URL;
+			break;
+
+			case PARSE_SPACE_AFTER_URL:
+			while(i < len && is_space(str[i]))
+				i += 1;
+
+			if(i == len)
+				NEED_MORE();
+
+			p->version_offset = i;
+			p->state = PARSE_VERSION;
+			break;
+
+			case PARSE_VERSION:
+			i += scanner.scan_text(str + i, len - i, '\r', '\r');
+
+			if(i == len)
+				NEED_MORE();
+
+			p->version_length = i - p->version_offset;
+
+			if(p->version_length == 0)
+				return FAILURE("Missing HTTP version");
+
+			if(str[i] != '\r')
+				return FAILURE("Bad character in HTTP version");
+
+			i += 1; // Skip the \r.
+			p->state = PARSE_VERSION_LF;
+			break;
+
+			case PARSE_VERSION_LF:
+			if(i == len)
+				NEED_MORE();
+
+			if(str[i] != '\n')
+				return FAILURE("Missing LF after CR");
+
+			i += 1; // Skip the \n.
+			p->state = PARSE_HEADER_START;
+			break;
+
+			case PARSE_HEADER_START:
+			if(i == len)
+				NEED_MORE();
+
+			if(str[i] == '\r')
+			{
+				// Blank line.
+				i += 1;
+				p->state = PARSE_BLANK_LF;
+				break;
+			}
+
+			p->hname_offset = i;
+			p->state = PARSE_HEADER_NAME;
+			break;
+
+			case PARSE_HEADER_NAME:
+			i += scanner.scan_token(str + i, len - i);
+
+			if(i == len)
+				NEED_MORE();
+
+			if(str[i] != ':')
+				return FAILURE("Bad character in header name");
+
+			p->hname_length = i - p->hname_offset;
+
+			if(p->hname_length == 0)
+				return FAILURE("Empty header name");
+
+			i += 1; // Skip the ':'.
+			p->mark = i;
+			p->state = PARSE_HEADER_VALUE;
+			break;
+
+			case PARSE_HEADER_VALUE:
+			i += scanner.scan_text(str + i, len - i, '\r', '\r');
+
+			if(i == len)
+				NEED_MORE();
+
+			// Control characters other than HTAB aren't
+			// allowed in header values.
+			if(str[i] != '\r')
+				return FAILURE("Bad character in header value");
+
+			if(p->header_count == p->header_capacity)
+			{
+				int new_capacity = p->header_capacity == 0 ? 8 : p->header_capacity * 2;
+
+				void *temp = arena_realloc(arena, p->headers, 
+					p->header_capacity * sizeof(header_span_t), 
+					new_capacity * sizeof(header_span_t));
+
+				if(temp == NULL)
+					return INTERNAL_FAILURE("No memory");
+
+				p->header_capacity = new_capacity;
+				p->headers = temp;
+			}
+
+			p->headers[p->header_count++] = (header_span_t) {
+				.name  = p->hname_offset, .name_len  = p->hname_length,
+				.value = p->mark,         .value_len = i - p->mark,
+			};
+
+			i += 1; // Skip the \r.
+			p->state = PARSE_HEADER_LF;
+			break;
+
+			case PARSE_HEADER_LF:
+			if(i == len)
+				NEED_MORE();
+
+			// A CR must always be followed by a LF.
+			if(str[i] != '\n')
+				return FAILURE("Malformed header");
+
+			i += 1; // Skip the '\n'.
+			p->state = PARSE_HEADER_START;
+			break;
+
+			case PARSE_BLANK_LF:
+			if(i == len)
+				NEED_MORE();
+
+			if(str[i] != '\n')
+				return FAILURE("Missing blank line");
+
+			i += 1; // Skip the '\n'.
+			p->state = PARSE_DONE;
+			break;
+
+			case PARSE_DONE:
+			break;
+		}
+	}
+	p->cur = i;
+
+	// The whole head was received. Now the pointers
+	// can be created and the tokens can be made
+	// zero-terminated, since the bytes around them 
+	// won't be looked at anymore.
+
+	// Well-known headers are classified here so that
+	// they can be looked up in constant time.
+	memset(req2->header_slots, 0, sizeof(req2->header_slots));
+
+	xh_table headers = { .list = NULL, .count = 0 };
+	if(p->header_count > 0)
+	{
+		headers.list = arena_alloc(arena, p->header_count * sizeof(xh_pair));
+		if(headers.list == NULL)
+			return INTERNAL_FAILURE("No memory");
+
+		for(int k = 0; k < p->header_count; k += 1)
+		{
+			header_span_t span = p->headers[k];
+			headers.list[k] = (xh_pair) {
+				{ str + span.name,  span.name_len  },
+				{ str + span.value, span.value_len },
+			};
+			str[span.name  + span.name_len ] = '\0';
+			str[span.value + span.value_len] = '\0';
+
+			int id = header_id(str + span.name, span.name_len);
+			if(id >= 0 && req2->header_slots[id] == 0)
+				req2->header_slots[id] = k + 1;
+		}
+		headers.count = p->header_count;
+	}
+
+	req->headers = headers;
+
+	uint32_t method_length  = p->method_length;
+	uint32_t version_offset = p->version_offset;
+	uint32_t version_length = p->version_length;
+
+	req->method = xh_string_new(str + p->method_offset, p->method_length);
+	req->URL    = xh_string_new(str +    p->URL_offset,    p->URL_length);
+	req->params = xh_string_new(str + p->params_offset, p->params_length);
+
+	str[ p->method_offset +  p->method_length] = '\0';
+	str[    p->URL_offset +     p->URL_length] = '\0';
+	str[ p->params_offset +  p->params_length] = '\0';
+	str[p->version_offset + p->version_length] = '\0';
+
+	// Validate the header.
+	{
+		bool unknown_method = 0;
+
+		#define PAIR(p, q) (uint64_t) (((uint64_t) p << 32) | (uint64_t) q)
+		switch(PAIR(req->method.str[0], method_length))
+		{
+			case PAIR('G', 3): req->method_id = XH_GET;     unknown_method = !!strcmp(req->method.str, "GET"); 	break;
+			case PAIR('H', 4): req->method_id = XH_HEAD;    unknown_method = !!strcmp(req->method.str, "HEAD"); break;
+			case PAIR('P', 4): req->method_id = XH_POST;    unknown_method = !!strcmp(req->method.str, "POST"); break;
+			case PAIR('P', 3): req->method_id = XH_PUT;     unknown_method = !!strcmp(req->method.str, "PUT"); 	break;
+			case PAIR('D', 6): req->method_id = XH_DELETE;  unknown_method = !!strcmp(req->method.str, "DELETE");  break;
+			case PAIR('C', 7): req->method_id = XH_CONNECT; unknown_method = !!strcmp(req->method.str, "CONNECT"); break;
+			case PAIR('O', 7): req->method_id = XH_OPTIONS; unknown_method = !!strcmp(req->method.str, "OPTIONS"); break;
+			case PAIR('T', 5): req->method_id = XH_TRACE;   unknown_method = !!strcmp(req->method.str, "TRACE"); break;
+			case PAIR('P', 5): req->method_id = XH_PATCH;   unknown_method = !!strcmp(req->method.str, "PATCH"); break;
+			default: unknown_method = 1; break;
+		}
+		#undef PAIR
+
+		if(unknown_method)
+		{
+			req->headers.list = NULL;
+			return FAILURE("Unknown method");
+		}
+	}
+
+	// Validate the HTTP version
+	{
+		bool bad_version = 0;
+		switch(version_length)
+		{
+			case sizeof("HTTP/M.N")-1:
+
+			if(!strcmp(str + version_offset, "HTTP/0.9"))
+			{
+				req->version_major = 0;
+				req->version_minor = 9;
+				break;
+			}
+
+			if(!strcmp(str + version_offset, "HTTP/1.0"))
+			{
+				req->version_major = 1;
+				req->version_minor = 0;
+				break;
+			}
+
+			if(!strcmp(str + version_offset, "HTTP/1.1"))
+			{
+				req->version_major = 1;
+				req->version_minor = 1;
+				break;
+			}
+
+			if(!strcmp(str + version_offset, "HTTP/2.0"))
+			{
+				req->version_major = 2;
+				req->version_minor = 0;
+				break;
+			}
+
+			if(!strcmp(str + version_offset, "HTTP/3.0"))
+			{
+				req->version_major = 3;
+				req->version_minor = 0;
+				break;
+			}
+
+			bad_version = 1;
+			break;
+
+			case sizeof("HTTP/M")-1:
+
+			if(!strcmp(str + version_offset, "HTTP/1"))
+			{
+				req->version_major = 1;
+				req->version_minor = 0;
+				break;
+			}
+
+			if(!strcmp(str + version_offset, "HTTP/2"))
+			{
+				req->version_major = 2;
+				req->version_minor = 0;
+				break;
+			}
+
+			if(!strcmp(str + version_offset, "HTTP/3"))
+			{
+				req->version_major = 3;
+				req->version_minor = 0;
+				break;
+			}
+
+			bad_version = 1;
+			break;
+
+			default:
+			bad_version = 1;
+			break;
+		}
+
+		if(bad_version)
+		{
+			req->headers.list = NULL;
+			return FAILURE("Bad HTTP version");
+		}
+	}
+
+	return OK;
+
+	#undef OK
+	#undef FAILURE
+	#undef INTERNAL_FAILURE
+	#undef NEED_MORE
+}
+
+/* Symbol: dechunk
+ *
+ *   Decode the bytes of a chunked body that follow
+ *   the [*decoded] bytes that were already decoded
+ *   starting at [body]. The data of the chunks is 
+ *   moved to the end of the decoded part and the 
+ *   framing is skipped. Trailer fields are ignored.
+ *   Decoding stops after the last chunk, leaving
+ *   what follows it where it is.
+ *
+ * Returns:
+ *   The offset (relative to [body]) of the first 
+ *   byte that wasn't consumed and, through [error],
+ *   an error message if the body is malformed or 
+ *   has more than [max_chunks] chunks (if it's not
+ *   0).
+ */
+static uint32_t dechunk(dechunker_t *d, char *body, uint32_t len, 
+                        uint32_t *decoded, uint32_t max_chunks,
+                        const char **error)
+{
+	uint32_t i = *decoded;
+	*error = NULL;
+
+	while(i < len && d->state != CHUNK_DONE)
+	{
+		if(d->state == CHUNK_DATA)
+		{
+			uint32_t n = len - i;
+			if(n > d->left)
+				n = d->left;
+
+			memmove(body + *decoded, body + i, n);
+			*decoded += n;
+			d->left -= n;
+			i += n;
+
+			if(d->left == 0)
+				d->state = CHUNK_DATA_CR;
+			continue;
+		}
+
+		char c = body[i];
+		i += 1;
+
+		switch(d->state)
+		{
+			case CHUNK_SIZE:
+			if(is_hex_digit(c))
+			{
+				if(d->left > (UINT64_MAX >> 4))
+				{
+					*error = "Chunk size too big";
+					return i;
+				}
+				int v = is_digit(c) ? c - '0' : (c | 32) - 'a' + 10;
+				d->left = (d->left << 4) | v;
+				d->digits = 1;
+			}
+			else if(d->digits && (c == ';' || c == ' ' || c == '\t'))
+				d->state = CHUNK_EXTENSION;
+			else if(d->digits && c == '\r')
+				d->state = CHUNK_SIZE_LF;
+			else
+			{
+				*error = "Bad chunk size";
+				return i;
+			}
+			break;
+
+			case CHUNK_EXTENSION:
+			// Extensions aren't supported,
+			// so they're skipped.
+			if(c == '\r')
+				d->state = CHUNK_SIZE_LF;
+			else if(c == '\n')
+			{
+				*error = "Bad chunk extension";
+				return i;
+			}
+			break;
+
+			case CHUNK_SIZE_LF:
+			if(c != '\n')
+			{
+				*error = "Missing LF after chunk size";
+				return i;
+			}
+
+			d->count += 1;
+			if(max_chunks > 0 && d->count > max_chunks)
+			{
+				*error = "Too many chunks";
+				return i;
+			}
+
+			d->state = d->left == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+			break;
+
+			case CHUNK_DATA_CR:
+			if(c != '\r')
+			{
+				*error = "Missing CRLF after chunk data";
+				return i;
+			}
+			d->state = CHUNK_DATA_LF;
+			break;
+
+			case CHUNK_DATA_LF:
+			if(c != '\n')
+			{
+				*error = "Missing CRLF after chunk data";
+				return i;
+			}
+			d->state = CHUNK_SIZE;
+			d->digits = 0;
+			break;
+
+			case CHUNK_TRAILER:
+			if(c == '\r')
+				d->state = CHUNK_LAST_LF;
+			else
+				d->state = CHUNK_TRAILER_LINE;
+			break;
+
+			case CHUNK_TRAILER_LINE:
+			if(c == '\r')
+				d->state = CHUNK_TRAILER_LF;
+			break;
+
+			case CHUNK_TRAILER_LF:
+			case CHUNK_LAST_LF:
+			if(c != '\n')
+			{
+				*error = "Missing LF after trailer";
+				return i;
+			}
+			d->state = d->state == CHUNK_LAST_LF ? CHUNK_DONE : CHUNK_TRAILER;
+			break;
+
+			default:
+			assert(0);
+			break;
+		}
+	}
+	return i;
+}
+
+/* Symbol: response_in_progress
+ *
+ *   Tells whether the last response's body is still
+ *   being sent from outside the output buffer. While
+ *   that's the case, no new requests are served so
+ *   that responses aren't sent out of order.
+ */
+static bool response_in_progress(conn_t *conn)
+{
+	return conn->sending_from_fd || conn->res_body.str != NULL || conn->producer != NULL;
+}
+
+/* Symbol: flush
+ *
+ *   Send the contents of the output buffer followed
+ *   by [len] bytes from [ptr] with as few syscalls
+ *   as possible, until the socket would block.
+ *
+ * Returns:
+ *   The number of bytes sent from [ptr] or -1 on
+ *   failure. Bytes sent from the output buffer are
+ *   consumed from it.
+ */
+static long flush(conn_t *conn, const char *ptr, uint32_t len)
+{
+	uint32_t sent_out = 0, sent_ptr = 0;
+
+	char    *out_ptr = conn->out.data + conn->out.head;
+	uint32_t out_len = buffer_count(&conn->out);
+
+	while(sent_out < out_len || sent_ptr < len)
+	{
+		struct iovec iov[2];
+		int iovcnt = 0;
+
+		if(sent_out < out_len)
+		{
+			iov[iovcnt].iov_base = out_ptr + sent_out;
+			iov[iovcnt].iov_len  = out_len - sent_out;
+			iovcnt += 1;
+		}
+
+		if(sent_ptr < len)
+		{
+			iov[iovcnt].iov_base = (char*) ptr + sent_ptr;
+			iov[iovcnt].iov_len  = len - sent_ptr;
+			iovcnt += 1;
+		}
+
+		ssize_t n = writev(conn->fd, iov, iovcnt);
+
+		if(n < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			if(errno == EINTR)
+				continue;
+
+			// ERROR!
+			return -1;
+		}
+
+		uint32_t m = out_len - sent_out;
+		if((size_t) n <= m)
+			sent_out += n;
+		else
+		{
+			sent_out += m;
+			sent_ptr += n - m;
+		}
+	}
+
+	buffer_consume(&conn->out, sent_out);
+	return sent_ptr;
+}
+
+#define PRODUCER_CHUNK_SIZE 16384
+
+/* Symbol: produce
+ *
+ *   Ask the producer of the response body for the
+ *   next piece of it and append it to the output 
+ *   buffer, framed as a chunk if chunked encoding
+ *   is used. When the body is over, the terminating
+ *   chunk is appended and the producer is stopped.
+ *
+ * Returns:
+ *   1 on success, 0 if the connection needs to be
+ *   closed.
+ */
+static bool produce(context_t *ctx, conn_t *conn)
+{
+	// Room for the size line of the chunk, its data,
+	// the CRLF that follows it and the last chunk.
+	if(!buffer_reserve(&ctx->buffers, &conn->out, PRODUCER_CHUNK_SIZE + 20))
+		return 0;
+
+	buffer_t *b = &conn->out;
+
+	// The size line is written after the data, so
+	// a fixed width is reserved for it.
+	uint32_t prefix = conn->chunked ? 10 : 0;
+
+	char *dst = b->data + b->used + prefix;
+	int n = conn->producer(dst, PRODUCER_CHUNK_SIZE, conn->producer_userp);
+
+	if(n < 0 || n > PRODUCER_CHUNK_SIZE)
+		return 0;
+
+	if(n == 0)
+	{
+		if(conn->chunked)
+		{
+			memcpy(b->data + b->used, "0\r\n\r\n", 5);
+			b->used += 5;
+		}
+		stop_producer(conn);
+		return 1;
+	}
+
+	if(conn->chunked)
+	{
+		static const char digits[] = "0123456789abcdef";
+		
+		char *line = b->data + b->used;
+		for(int i = 0; i < 8; i += 1)
+			line[i] = digits[(n >> (28 - 4 * i)) & 15];
+		line[8] = '\r';
+		line[9] = '\n';
+
+		memcpy(dst + n, "\r\n", 2);
+		b->used += prefix + n + 2;
+	}
+	else
+		b->used += n;
+	return 1;
+}
+
+static void next_part(context_t *ctx, conn_t *conn);
+
+// Maximum number of bytes [sendfile] transfers 
+// per call.
+#define SENDFILE_MAX 0x7ffff000
+
+static bool upload(context_t *ctx, conn_t *conn)
+{
+	if(conn->failed_to_append)
+		return 0;
+
+	// Bytes of the body sent by this call, from
+	// memory, a file or the producer. They all
+	// count against [sendfile_budget].
+	uint64_t sent = 0;
+	conn->throttled = 0;
+
+	// This is repeated for each part of a 
+	// multipart/byteranges body.
+	while(1)
+	{
+		if(buffer_count(&conn->out) > 0 || conn->res_body.str != NULL)
+		{
+			/* Flush the output buffer and the response 
+			 * body that's referenced by the connection
+			 * (if there is one) in a single writev.
+			 */
+			const char *ptr = NULL;
+			uint32_t     len = 0;
+
+			if(conn->res_body.str != NULL)
+			{
+				ptr = conn->res_body.str + conn->res_body_sent;
+				len = conn->res_body.len - conn->res_body_sent;
+
+				if(ctx->sendfile_budget > 0 && len > ctx->sendfile_budget - sent)
+					len = ctx->sendfile_budget - sent;
+			}
+
+			long n = flush(conn, ptr, len);
+
+			if(n < 0)
+				return 0;
+
+			sent += n;
+
+			if(conn->res_body.str != NULL)
+			{
+				conn->res_body_sent += n;
+				if(conn->res_body_sent == (uint32_t) conn->res_body.len)
+					release_body(conn);
+				else if((uint32_t) n == len && buffer_count(&conn->out) == 0)
+					// The socket took all it was given,
+					// so it was the budget that stopped
+					// the body.
+					conn->throttled = 1;
+			}
+		}
+
+		if(conn->sending_from_fd && buffer_count(&conn->out) == 0)
+		{
+			/* Tell the kernel to use sendfile. The offset
+			 * is explicit since the file descriptor may be
+			 * shared with other connections. */
+			do
+			{
+				// Don't send more than [sendfile_budget] bytes
+				// in one go, so that the other connections get
+				// a chance to be served.
+				uint64_t count = conn->file_len - conn->file_off;
+				if(ctx->sendfile_budget > 0)
+				{
+					if(sent >= ctx->sendfile_budget)
+					{
+						conn->throttled = 1;
+						break;
+					}
+					if(count > ctx->sendfile_budget - sent)
+						count = ctx->sendfile_budget - sent;
+				}
+				if(count > SENDFILE_MAX)
+					count = SENDFILE_MAX;
+
+				off_t offset = conn->file_off;
+				ssize_t n = sendfile(conn->fd, conn->file_fd, &offset, count);
+			
+				if(n < 0)
+				{
+					if(errno == EAGAIN)
+						// Would block, we're done.
+						break;
+
+					// An error occurred.
+					return 0;
+				}
+
+				if(n == 0)
+					// The file is shorter than the length in
+					// the head (it was truncated after being
+					// opened), so the response can't be completed.
+					return 0;
+
+				conn->file_off += n;
+				sent += n;
+			}
+			while(conn->file_off < conn->file_len);
+
+			if(conn->file_off == conn->file_len)
+			{
+				if(conn->parts != NULL)
+				{
+					// Done sending a range of a multipart 
+					// body. Queue the head of the next part
+					// and go on.
+					next_part(ctx, conn);
+					if(conn->failed_to_append)
+						return 0;
+					continue;
+				}
+
+				// Done sending the file.
+				close_file(ctx, conn->file_fd, conn->file_entry);
+				conn->sending_from_fd = 0;
+			}
+		}
+		break;
+	}
+
+	/* Generate the body as long as the socket 
+	 * takes it. The budget is checked before each
+	 * chunk, so it may be exceeded by one. */
+	while(conn->producer != NULL && buffer_count(&conn->out) == 0)
+	{
+		if(ctx->sendfile_budget > 0 && sent >= ctx->sendfile_budget)
+		{
+			conn->throttled = 1;
+			break;
+		}
+
+		if(!produce(ctx, conn))
+			return 0;
+
+		uint32_t count = buffer_count(&conn->out);
+
+		if(flush(conn, NULL, 0) < 0)
+			return 0;
+
+		sent += count - buffer_count(&conn->out);
+	}
+	return 1;
+}
+
+static void append_string_to_output_buffer(context_t *ctx, conn_t *conn, xh_string data)
+{
+	if(conn->sending_from_fd)
+		conn->failed_to_append = 1;
+
+	if(conn->failed_to_append)
+		return;
+
+	if(!buffer_reserve(&ctx->buffers, &conn->out, data.len))
+	{
+		conn->failed_to_append = 1;
+		return;
+	}
+
+	memcpy(conn->out.data + conn->out.used, data.str, data.len);
+	conn->out.used += data.len;
+	return;
+}
+
+/* Symbol: connection_has_option
+ *
+ *   Tell whether the [Connection] header value [list], 
+ *   which is a comma-separated list of options, contains
+ *   [option] (case-insensitive).
+ */
+static bool connection_has_option(const char *list, const char *option)
+{
+	size_t len = strlen(option);
+
+	while(*list != '\0')
+	{
+		list += strspn(list, " \t,");
+
+		size_t n = strcspn(list, " \t,");
+		if(n == len && !strncasecmp(list, option, len))
+			return 1;
+		list += n;
+	}
+	return 0;
+}
+
+static bool client_wants_to_keep_alive(xh_request *req)
+{
+	const char *h_connection = xh_header_get_id(req, XH_HDR_CONNECTION);
+
+	// Starting from HTTP/1.1 connections are persistent 
+	// unless the client says otherwise. Before that,
+	// they're closed unless the client asks for them
+	// to be kept alive.
+	if(req->version_major > 1 || (req->version_major == 1 && req->version_minor >= 1))
+		return h_connection == NULL || !connection_has_option(h_connection, "close");
+	else
+		return h_connection != NULL && connection_has_option(h_connection, "keep-alive");
+}
+
+static bool server_wants_to_keep_alive(context_t *ctx, conn_t *conn)
+{
+	bool keep_alive = 1;
+
+	if(ctx->keep_alive_max_requests > 0 
+		&& conn->served + 1 >= (int) ctx->keep_alive_max_requests)
+		keep_alive = 0;
+
+	if((uint64_t) ctx->connum * 100 > (uint64_t) ctx->keep_alive_threshold * ctx->maxconns)
+		keep_alive = 0;
+
+	return keep_alive;
+}
+
+static void append_response_status_line_to_output_buffer(context_t *ctx, conn_t *conn, int status)
+{
+	if(status >= 100 && status < 600 && status_lines[status - 100].str != NULL)
+	{
+		append_string_to_output_buffer(ctx, conn, status_lines[status - 100]);
+		return;
+	}
+
+	// Unknown status codes are rare enough
+	// to be formatted.
+	char buffer[64];
+
+	int n = snprintf(buffer, sizeof(buffer), "HTTP/1.1 %d ???\r\n", status);
+	assert(n >= 0);
+
+	if((unsigned int) n > sizeof(buffer)-1)
+		n = sizeof(buffer)-1;
+
+	append_string_to_output_buffer(ctx, conn, xh_string_new(buffer, n));
+}
+
+/* Symbol: append_response_head_to_output_buffer
+ *
+ *   Write the status line and the headers of a 
+ *   response. If it's served from the cache, the
+ *   stored head of the [cached] entry is written
+ *   instead of the status line and only the Date
+ *   and the headers added to [res] follow it.
+ */
+static void append_response_head_to_output_buffer(context_t *ctx, xh_response *res, conn_t *conn,
+                                                  const response_entry_t *cached)
+{
+	// Cached heads never have a Date, so they
+	// always get the current one.
+	bool has_date = 0;
+	if(cached != NULL)
+		append_string_to_output_buffer(ctx, conn, cached->head);
+	else
+	{
+		append_response_status_line_to_output_buffer(ctx, conn, res->status);
+		has_date = xh_header_get_id(res, XH_HDR_DATE) != NULL;
+	}
+
+	// Unless the callback provided its own.
+	if(!has_date)
+		append_string_to_output_buffer(ctx, conn, xh_string_new(ctx->date_line, ctx->date_len));
+
+	for(int i = 0; i < res->headers.count; i += 1)
+	{
+		xh_pair header = res->headers.list[i];
+		append_string_to_output_buffer(ctx, conn, header.key);
+		append_string_to_output_buffer(ctx, conn, xh_string_from_literal(": "));
+		append_string_to_output_buffer(ctx, conn, header.val);
+		append_string_to_output_buffer(ctx, conn, xh_string_from_literal("\r\n"));
+	}
+	append_string_to_output_buffer(ctx, conn, xh_string_from_literal("\r\n"));
+}
+
+static const char day_names[7][4] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat",
+};
+
+static const char month_names[12][4] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", 
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+/* Symbol: format_http_date
+ *
+ *   Write [t] in the IMF-fixdate format used by
+ *   HTTP (like "Sun, 06 Nov 1994 08:49:37 GMT").
+ *   The names are written explicitly since the
+ *   ones of [strftime] depend on the locale.
+ */
+static void format_http_date(char dst[64], time_t t)
+{
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	(void) snprintf(dst, 64, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+		day_names[tm.tm_wday], tm.tm_mday, month_names[tm.tm_mon], 
+		tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/* Symbol: format_uint64
+ *
+ *   Write the decimal digits of [n] into [dst],
+ *   which must have room for 20 of them, without
+ *   going through printf.
+ *
+ * Returns:
+ *   The number of digits.
+ */
+static int format_uint64(char *dst, uint64_t n)
+{
+	char tmp[20];
+	int  len = 0;
+	do
+	{
+		tmp[len++] = '0' + n % 10;
+		n /= 10;
+	}
+	while(n > 0);
+
+	for(int i = 0; i < len; i += 1)
+		dst[i] = tmp[len - i - 1];
+	return len;
+}
+
+/* Symbol: update_date
+ *
+ *   Format the "Date" header line sent with every
+ *   response again if the second changed since 
+ *   the last time.
+ */
+static void update_date(context_t *ctx)
+{
+	time_t now = time(NULL);
+	if(now == ctx->date_time)
+		return;
+
+	char date[64];
+	format_http_date(date, now);
+
+	int n = snprintf(ctx->date_line, sizeof(ctx->date_line), "Date: %s\r\n", date);
+	assert(n > 0 && (size_t) n < sizeof(ctx->date_line));
+
+	ctx->date_len = n;
+	ctx->date_time = now;
+}
+
+/* Symbol: parse_http_date
+ *
+ *   Parse a date in the IMF-fixdate format. The
+ *   obsolete formats aren't supported, so dates
+ *   using them are treated as invalid.
+ *
+ * Returns:
+ *   1 on success, 0 if the date is invalid.
+ */
+static bool parse_http_date(const char *src, time_t *t)
+{
+	char day[4], month[4];
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+
+	while(*src == ' ' || *src == '\t')
+		src += 1;
+
+	int n = 0;
+	if(sscanf(src, "%3[A-Za-z], %2d %3s %4d %2d:%2d:%2d GMT%n", day, &tm.tm_mday, month, 
+		      &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) != 7 || n == 0)
+		return 0;
+
+	tm.tm_mon = -1;
+	for(int i = 0; i < 12; i += 1)
+		if(!strcmp(month, month_names[i]))
+			tm.tm_mon = i;
+
+	if(tm.tm_mon < 0)
+		return 0;
+
+	tm.tm_year -= 1900;
+	*t = timegm(&tm);
+	return 1;
+}
+
+/* Symbol: make_etag
+ *
+ *   Build the entity tag of a file from its inode,
+ *   size and modification time.
+ */
+static void make_etag(char dst[64], const struct stat *info)
+{
+	(void) snprintf(dst, 64, "\"%llx-%llx-%llx\"", 
+		(unsigned long long) info->st_ino, 
+		(unsigned long long) info->st_size,
+		(unsigned long long) info->st_mtim.tv_sec * 1000000000 + info->st_mtim.tv_nsec);
+}
+
+/* Symbol: etag_matches
+ *
+ *   Tell whether [etag] is one of the entity tags
+ *   in the comma-separated [list] (or if the list
+ *   is "*"). With the [weak] comparison, the W/ 
+ *   prefix is ignored. Otherwise weak tags never
+ *   match.
+ */
+static bool etag_matches(const char *list, const char *etag, bool weak)
+{
+	size_t len = strlen(etag);
+	size_t i = 0;
+	while(1)
+	{
+		while(list[i] == ' ' || list[i] == '\t' || list[i] == ',')
+			i += 1;
+
+		if(list[i] == '\0')
+			return 0;
+
+		if(list[i] == '*')
+			return 1;
+
+		bool is_weak = 0;
+		if(list[i] == 'W' && list[i+1] == '/')
+		{
+			is_weak = 1;
+			i += 2;
+		}
+
+		size_t start = i;
+		if(list[i] == '"')
+		{
+			i += 1;
+			while(list[i] != '"' && list[i] != '\0')
+				i += 1;
+			if(list[i] == '"')
+				i += 1;
+		}
+		else
+			while(list[i] != ',' && list[i] != '\0')
+				i += 1;
+
+		if((weak || !is_weak) && i - start == len && !strncmp(list + start, etag, len))
+			return 1;
+	}
+}
+
+#define MAX_RANGES 16
+
+/* Symbol: parse_ranges
+ *
+ *   Parse the value of a Range header for a file of
+ *   [size] bytes. Ranges that go past the end of the
+ *   file are shortened and the ones that start after
+ *   it are dropped.
+ *
+ * Returns:
+ *   The number of ranges, 0 if none of them can be
+ *   satisfied or -1 if the header must be ignored
+ *   because it's malformed, it doesn't use bytes as
+ *   unit or it has more than [max] ranges.
+ */
+static int parse_ranges(const char *src, uint64_t size, byte_range_t *ranges, int max)
+{
+	while(*src == ' ' || *src == '\t')
+		src += 1;
+
+	if(strncmp(src, "bytes=", 6))
+		return -1;
+
+	int count = 0;
+	size_t i = 6;
+	while(1)
+	{
+		while(src[i] == ' ' || src[i] == '\t')
+			i += 1;
+
+		bool has_first = 0, has_last = 0;
+		uint64_t first = 0, last = 0;
+
+		while(is_digit(src[i]))
+		{
+			if(first > (UINT64_MAX - 9) / 10)
+				return -1;
+			first = first * 10 + src[i] - '0';
+			has_first = 1;
+			i += 1;
+		}
+
+		if(src[i] != '-')
+			return -1;
+		i += 1;
+
+		while(is_digit(src[i]))
+		{
+			if(last > (UINT64_MAX - 9) / 10)
+				return -1;
+			last = last * 10 + src[i] - '0';
+			has_last = 1;
+			i += 1;
+		}
+
+		if(!has_first && !has_last)
+			return -1;
+
+		if(has_first && has_last && last < first)
+			return -1;
+
+		if(!has_first)
+		{
+			// Suffix range: the last [last] bytes.
+			if(last > 0 && size > 0)
+			{
+				first = last > size ? 0 : size - last;
+				last  = size - 1;
+				has_first = 1;
+			}
+		}
+		else if(!has_last || last >= size)
+			last = size - 1;
+
+		if(has_first && first < size)
+		{
+			if(count == max)
+				return -1;
+			ranges[count].first = first;
+			ranges[count].last  = last;
+			count += 1;
+		}
+
+		while(src[i] == ' ' || src[i] == '\t')
+			i += 1;
+
+		if(src[i] == '\0')
+			break;
+
+		if(src[i] != ',')
+			return -1;
+		i += 1;
+	}
+	return count;
+}
+
+/* Symbol: format_part_head
+ *
+ *   Write the delimiter and the headers that come
+ *   before the [i]-th range of a multipart body or,
+ *   if [i] is the number of ranges, the delimiter
+ *   that closes it.
+ *
+ * Returns:
+ *   The length of the text, like [snprintf].
+ */
+static int format_part_head(char *dst, size_t max, multipart_t *parts, int i)
+{
+	if(i == parts->count)
+		return snprintf(dst, max, "\r\n--%s--\r\n", parts->boundary);
+
+	return snprintf(dst, max, 
+		"\r\n--%s\r\n"
+		"%s%s%s"
+		"Content-Range: bytes %llu-%llu/%llu\r\n"
+		"\r\n",
+		parts->boundary, 
+		parts->content_type ? "Content-Type: " : "",
+		parts->content_type ? parts->content_type : "",
+		parts->content_type ? "\r\n" : "",
+		(unsigned long long) parts->ranges[i].first,
+		(unsigned long long) parts->ranges[i].last,
+		(unsigned long long) parts->size);
+}
+
+/* Symbol: negotiate_file_response
+ *
+ *   Add the validators of a file to its response and
+ *   evaluate the conditional and range headers of 
+ *   the request against them. The status is changed
+ *   to 304, 206 or 416 if needed and the part of the
+ *   file that must be sent is returned through 
+ *   [offset] and [length] or, for more than one 
+ *   range, through [parts] (in which case [length]
+ *   is the one of the whole multipart body).
+ *
+ * Returns:
+ *   0 if no part of the file must be sent, 1 if
+ *   it must, or -1 if there's no memory.
+ */
+static int negotiate_file_response(xh_request *req, xh_response *res, const struct stat *info,
+                                   uint64_t *offset, uint64_t *length, multipart_t **parts)
+{
+	uint64_t size = info->st_size;
+
+	*offset = 0;
+	*length = size;
+	*parts  = NULL;
+
+	if(res->status != 200)
+		return 1;
+
+	// The callback may provide its own validators.
+	if(xh_header_get_id(res, XH_HDR_ETAG) == NULL)
+	{
+		char etag[64];
+		make_etag(etag, info);
+		xh_header_add_string(res, xh_string_from_literal("ETag"), xh_string_new(etag, -1), XH_COPY);
+	}
+
+	if(xh_header_get_id(res, XH_HDR_LAST_MODIFIED) == NULL)
+	{
+		char date[64];
+		format_http_date(date, info->st_mtime);
+		xh_header_add_string(res, xh_string_from_literal("Last-Modified"), xh_string_new(date, -1), XH_COPY);
+	}
+
+	xh_header_add_string(res, xh_string_from_literal("Accept-Ranges"), xh_string_from_literal("bytes"), XH_BORROW);
+
+	const char *etag = xh_header_get_id(res, XH_HDR_ETAG);
+
+	time_t modified;
+	if(!parse_http_date(xh_header_get_id(res, XH_HDR_LAST_MODIFIED), &modified))
+		modified = info->st_mtime;
+
+	if(req->method_id != XH_GET || etag == NULL)
+		return 1;
+
+	// If-Modified-Since is only considered when
+	// there's no If-None-Match.
+	const char *if_none_match     = xh_header_get_id(req, XH_HDR_IF_NONE_MATCH);
+	const char *if_modified_since = xh_header_get_id(req, XH_HDR_IF_MODIFIED_SINCE);
+
+	bool not_modified = 0;
+	if(if_none_match != NULL)
+		not_modified = etag_matches(if_none_match, etag, 1);
+	else if(if_modified_since != NULL)
+	{
+		time_t since;
+		if(parse_http_date(if_modified_since, &since))
+			not_modified = (modified <= since);
+	}
+
+	if(not_modified)
+	{
+		res->status = 304;
+		return 0;
+	}
 
-	skip(str, len, &i, 0, is_space);
+	const char *range = xh_header_get_id(req, XH_HDR_RANGE);
+	if(range == NULL)
+		return 1;
 
-	if(i == len)
-		return FAILURE("Missing HTTP version");
+	// If the client's copy isn't the current one,
+	// the whole file is sent.
+	const char *if_range = xh_header_get_id(req, XH_HDR_IF_RANGE);
+	if(if_range != NULL)
+	{
+		time_t date;
+		bool current;
+		if(parse_http_date(if_range, &date))
+			current = (date == modified);
+		else
+			current = etag_matches(if_range, etag, 0);
 
-	uint32_t version_offset = i;
+		if(!current)
+			return 1;
+	}
 
-	skip_until(str, len, &i, '\r');
+	byte_range_t ranges[MAX_RANGES];
+	int count = parse_ranges(range, size, ranges, MAX_RANGES);
 
-	uint32_t version_length = i - version_offset;
+	if(count < 0)
+		return 1;
 
-	if(version_length == 0)
-		return FAILURE("Missing HTTP version");
+	if(count == 0)
+	{
+		res->status = 416;
+		xh_header_add(res, "Content-Range", "bytes */%llu", (unsigned long long) size);
+		return 0;
+	}
 
-	if(i == len)
-		return FAILURE("Missing CRLF after HTTP version");
+	res->status = 206;
 
-	assert(str[i] == '\r');
+	if(count == 1)
+	{
+		xh_header_add(res, "Content-Range", "bytes %llu-%llu/%llu", 
+			(unsigned long long) ranges[0].first, 
+			(unsigned long long) ranges[0].last,
+			(unsigned long long) size);
+		*offset = ranges[0].first;
+		*length = ranges[0].last - ranges[0].first + 1;
+		return 1;
+	}
 
-	i += 1; // Skip the \r.
+	const char *content_type = xh_header_get_id(res, XH_HDR_CONTENT_TYPE);
+	size_t type_len = content_type ? strlen(content_type) : 0;
 
-	if(i == len)
-		return FAILURE("Missing LF after CR");
+	multipart_t *multi = malloc(sizeof(multipart_t) + count * sizeof(byte_range_t) + type_len + 1);
+	if(multi == NULL)
+		return -1;
 
-	if(str[i] != '\n')
-		return FAILURE("Missing LF after CR");
+	multi->count = count;
+	multi->next  = 0;
+	multi->size  = size;
+	memcpy(multi->ranges, ranges, count * sizeof(byte_range_t));
 
-	i += 1; // Skip the \n.
+	multi->content_type = NULL;
+	if(content_type != NULL)
+	{
+		multi->content_type = (char*) (multi->ranges + count);
+		memcpy(multi->content_type, content_type, type_len + 1);
+	}
 
-	int capacity = 0;
-	xh_table headers = { 
-		.list = NULL, .count = 0 };
+	// The boundary only needs to be unlikely to
+	// appear in the file.
+	uint64_t seed = (uint64_t) info->st_ino * 0x9E3779B97F4A7C15ull ^ current_time_ms() ^ (uintptr_t) multi;
+	seed ^= seed >> 31;
+	seed *= 0xBF58476D1CE4E5B9ull;
+	seed ^= seed >> 29;
+	(void) snprintf(multi->boundary, sizeof(multi->boundary), "%016llx", (unsigned long long) seed);
 
-	while(1)
+	uint64_t total = 0;
+	for(int i = 0; i <= count; i += 1)
 	{
-		if(i == len)
-		{
-			free(headers.list);
-			return FAILURE("Missing blank line");
-		}
+		total += format_part_head(NULL, 0, multi, i);
+		if(i < count)
+			total += ranges[i].last - ranges[i].first + 1;
+	}
 
-		if(i+1 < len && str[i] == '\r' && str[i+1] == '\n')
-		{
-			// Blank line.
-			i += 2;
-			break;
-		}
+	xh_header_rem(res, "Content-Type");
+	xh_header_add(res, "Content-Type", "multipart/byteranges; boundary=%s", multi->boundary);
 
-		uint32_t hname_offset = i;
+	*length = total;
+	*parts  = multi;
+	return 1;
+}
 
-		skip_until(str, len, &i, ':');
+/* Symbol: next_part
+ *
+ *   Move on to the next part of a multipart/byteranges
+ *   body by appending its head to the output buffer and
+ *   making its range the one that's sent from the file.
+ *   After the last part, the closing delimiter is 
+ *   appended instead and the file is closed.
+ */
+static void next_part(context_t *ctx, conn_t *conn)
+{
+	multipart_t *parts = conn->parts;
 
-		uint32_t hname_length = i - hname_offset;
+	// Nothing can be appended while a 
+	// file is being sent.
+	conn->sending_from_fd = 0;
 
-		if(i == len)
-		{
-			free(headers.list);
-			return FAILURE("Malformed header");
-		}
+	char head[512];
+	int len = format_part_head(head, sizeof(head), parts, parts->next);
 
-		if(hname_length == 0)
-		{
-			free(headers.list);
-			return FAILURE("Empty header name");
+	if(len < 0 || (size_t) len >= sizeof(head))
+	{
+		conn->failed_to_append = 1;
+		return;
+	}
+	append_string_to_output_buffer(ctx, conn, xh_string_new(head, len));
+
+	if(parts->next == parts->count)
+	{
+		close_file(ctx, conn->file_fd, conn->file_entry);
+		free(parts);
+		conn->parts = NULL;
+		return;
+	}
+
+	conn->file_off = parts->ranges[parts->next].first;
+	conn->file_len = parts->ranges[parts->next].last + 1;
+	conn->sending_from_fd = 1;
+	parts->next += 1;
+}
+
+typedef enum { 
+	ORF_OK,   ORF_FORBIDDEN, 
+	ORF_NOTFOUND, ORF_OTHER,
+} orf_result_t;
+
+static orf_result_t open_regular_file(const char *file, struct stat *info, int *fd)
+{
+	assert(fd != NULL);
+
+	*fd = open(file, O_RDONLY);
+	if(*fd < 0) {
+		switch(errno) {
+			case EACCES: return ORF_FORBIDDEN;
+			case ENOENT: return ORF_NOTFOUND;
 		}
+		return ORF_OTHER;
+	}
 
-		assert(str[i] == ':');
+	if(fstat(*fd, info))
+		{ close(*fd); return ORF_OTHER; }
 
-		// Make the header name zero-terminated
-		// by overwriting the ':' with a '\0'.
-		str[i] = '\0';
+	if(!S_ISREG(info->st_mode)) // Path doesn't refer to a regular file.
+		{ close(*fd); return ORF_OTHER; }
 
-		i += 1; // Skip the ':'.
+	return ORF_OK;
+}
 
-		uint32_t hvalue_offset = i;
+// Changes to a file that invalidate its cache entry.
+// Since the cache holds the file open, deleting it
+// or replacing it with a rename is only reported as
+// a change of its link count (IN_ATTRIB).
+#define FILE_WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
 
-		do
-		{
-			skip_until(str, len, &i, '\r');
+/* Symbol: open_file
+ *
+ *   Open a file for a [xh_response.file] response,
+ *   or get it from the worker's cache. The entry 
+ *   of the cache is returned through [entry] (NULL
+ *   if the file isn't cached) and [fd] must be 
+ *   closed with [close_file].
+ */
+static orf_result_t open_file(context_t *ctx, const char *path, 
+                              struct stat *info, int *fd, 
+                              file_entry_t **entry)
+{
+	file_cache_t *cache = &ctx->files;
 
-			if(i == len)
-			{
-				free(headers.list);
-				return FAILURE("Malformed header");
-			}
+	*entry = NULL;
 
-			assert(str[i] == '\r');
+	if(cache->capacity == 0)
+		return open_regular_file(path, info, fd);
 
-			i += 1; // Skip the \r.
+	file_entry_t *found = file_cache_lookup(cache, path);
+	if(found == NULL)
+	{
+		// The watch is added before opening the file,
+		// so that no change after the open can go
+		// unnoticed.
+		int wd = -1;
+		if(cache->inotify >= 0)
+			wd = inotify_add_watch(cache->inotify, path, FILE_WATCH_EVENTS);
 
-			if(i == len)
-			{
-				free(headers.list);
-				return FAILURE("Malformed header");
-			}
-		}
-		while(str[i] != '\n');
-		assert(str[i] == '\n');
-		i += 1; // Skip the '\n'.
+		orf_result_t result = open_regular_file(path, info, fd);
 
-		uint32_t hvalue_length = (i - 2) - hvalue_offset;
+		if(result == ORF_OK)
+			found = file_cache_insert(cache, path, *fd, wd, info);
 
-		if(headers.count == capacity)
+		if(found == NULL)
 		{
-			int new_capacity = capacity == 0 ? 8 : capacity * 2;
+			if(wd >= 0)
+				file_cache_unwatch(cache, wd);
+			return result;
+		}
 
-			void *temp = realloc(headers.list, 
-				new_capacity * sizeof(xh_pair));
+		// Only make room once the file was opened, so
+		// that requests for missing files can't flush
+		// the cache. It's done after the insertion since
+		// the evicted entry may share the watch of the
+		// new one.
+		if(cache->count > cache->capacity)
+			file_cache_remove(cache, cache->tail);
+	}
 
-			if(temp == NULL)
-			{
-				free(headers.list);
-				return INTERNAL_FAILURE("No memory");
-			}
+	found->refs += 1;
+	*fd = found->fd;
+	*info = found->info;
+	*entry = found;
+	return ORF_OK;
+}
 
-			capacity = new_capacity;
-			headers.list = temp;
-		}
+/* Symbol: xh_router
+ *
+ *   The routes are stored in a trie with a node for
+ *   each segment of their patterns. The literal 
+ *   children of a node are kept sorted by label so
+ *   that they can be looked up with a binary search,
+ *   while its ":d" and ":s" children are kept apart.
+ *   When matching a URL, literal segments are tried
+ *   before ":d" ones, which are tried before ":s" ones.
+ */
 
-		headers.list[headers.count++] = (xh_pair) {
-			{ str +  hname_offset,  hname_length },
-			{ str + hvalue_offset, hvalue_length },
-		};
+typedef struct route_t route_t;
+struct route_t {
+	route_t    *next;
+	int         methods;
+	xh_callback callback;
+	void       *userp;
+};
+
+typedef struct route_node_t route_node_t;
+struct route_node_t {
+	char *label;
+	int   label_len;
+
+	route_node_t **children; // Sorted by label.
+	int            children_count;
+	int            children_capacity;
+
+	route_node_t *number; // ":d"
+	route_node_t *string; // ":s"
+
+	route_t *routes;
+	int      methods; // Methods of all [routes].
+};
+
+struct xh_router {
+	route_node_t root;
+};
+
+xh_router *xh_router_create(void)
+{
+	xh_router *router = malloc(sizeof(xh_router));
+	if(router != NULL)
+		memset(router, 0, sizeof(xh_router));
+	return router;
+}
+
+static void route_node_free(route_node_t *node)
+{
+	for(int i = 0; i < node->children_count; i += 1)
+	{
+		route_node_free(node->children[i]);
+		free(node->children[i]);
+	}
+	free(node->children);
 
-		str[ hname_offset +  hname_length] = '\0';
-		str[hvalue_offset + hvalue_length] = '\0';
+	if(node->number != NULL)
+	{
+		route_node_free(node->number);
+		free(node->number);
 	}
 
-	req->headers = headers;
+	if(node->string != NULL)
+	{
+		route_node_free(node->string);
+		free(node->string);
+	}
 
-	req->method = xh_string_new(str + method_offset, method_length);
-	req->URL    = xh_string_new(str +    URL_offset,    URL_length);
-	req->params = xh_string_new(str + params_offset, params_length);
+	route_t *route = node->routes;
+	while(route != NULL)
+	{
+		route_t *next = route->next;
+		free(route);
+		route = next;
+	}
 
-	str[ method_offset +  method_length] = '\0';
-	str[    URL_offset +     URL_length] = '\0';
-	str[ params_offset +  params_length] = '\0';
-	str[version_offset + version_length] = '\0';
+	free(node->label);
+}
 
-	// Validate the header.
+void xh_router_free(xh_router *router)
+{
+	if(router != NULL)
 	{
-		bool unknown_method = 0;
+		route_node_free(&router->root);
+		free(router);
+	}
+}
 
-		#define PAIR(p, q) (uint64_t) (((uint64_t) p << 32) | (uint64_t) q)
-		switch(PAIR(req->method.str[0], method_length))
-		{
-			case PAIR('G', 3): req->method_id = XH_GET;     unknown_method = !!strcmp(req->method.str, "GET"); 	break;
-			case PAIR('H', 4): req->method_id = XH_HEAD;    unknown_method = !!strcmp(req->method.str, "HEAD"); break;
-			case PAIR('P', 4): req->method_id = XH_POST;    unknown_method = !!strcmp(req->method.str, "POST"); break;
-			case PAIR('P', 3): req->method_id = XH_PUT;     unknown_method = !!strcmp(req->method.str, "PUT"); 	break;
-			case PAIR('D', 6): req->method_id = XH_DELETE;  unknown_method = !!strcmp(req->method.str, "DELETE");  break;
-			case PAIR('C', 7): req->method_id = XH_CONNECT; unknown_method = !!strcmp(req->method.str, "CONNECT"); break;
-			case PAIR('O', 7): req->method_id = XH_OPTIONS; unknown_method = !!strcmp(req->method.str, "OPTIONS"); break;
-			case PAIR('T', 5): req->method_id = XH_TRACE;   unknown_method = !!strcmp(req->method.str, "TRACE"); break;
-			case PAIR('P', 5): req->method_id = XH_PATCH;   unknown_method = !!strcmp(req->method.str, "PATCH"); break;
-			default: unknown_method = 1; break;
-		}
-		#undef PAIR
+/* Symbol: find_child
+ *
+ *   Look for the literal child of [node] labeled
+ *   [label]. 
+ *
+ * Returns:
+ *   The index of the child if it's found, or the
+ *   index it would need to be inserted at.
+ */
+static int find_child(const route_node_t *node, const char *label, int len, bool *found)
+{
+	int lo = 0;
+	int hi = node->children_count;
+	while(lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		const route_node_t *child = node->children[mid];
 
-		if(unknown_method)
+		int min = child->label_len < len ? child->label_len : len;
+		int cmp = memcmp(child->label, label, min);
+		if(cmp == 0)
+			cmp = child->label_len - len;
+
+		if(cmp == 0)
 		{
-			free(headers.list);
-			req->headers.list = NULL;
-			return FAILURE("Unknown method");
+			*found = 1;
+			return mid;
 		}
+
+		if(cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	*found = 0;
+	return lo;
+}
 
-	// Validate the HTTP version
+static route_node_t *add_child(route_node_t *node, int index, const char *label, int len)
+{
+	if(node->children_count == node->children_capacity)
 	{
-		bool bad_version = 0;
-		switch(version_length)
+		int capacity = node->children_capacity == 0 ? 4 : 2 * node->children_capacity;
+
+		route_node_t **children = realloc(node->children, capacity * sizeof(route_node_t*));
+		if(children == NULL)
+			return NULL;
+
+		node->children = children;
+		node->children_capacity = capacity;
+	}
+
+	route_node_t *child = calloc(1, sizeof(route_node_t));
+	if(child == NULL)
+		return NULL;
+
+	child->label = malloc(len + 1);
+	if(child->label == NULL)
+	{
+		free(child);
+		return NULL;
+	}
+	memcpy(child->label, label, len);
+	child->label[len] = '\0';
+	child->label_len = len;
+
+	memmove(node->children + index + 1, 
+	        node->children + index, 
+	        (node->children_count - index) * sizeof(route_node_t*));
+	node->children[index] = child;
+	node->children_count += 1;
+	return child;
+}
+
+/* Symbol: xh_route
+ *
+ *   Register [callback] to be called for the requests
+ *   with one of the [methods] (an OR of [xh_method]
+ *   values) and a URL matching [pattern]. Routes must
+ *   be registered before the router is given to [xhttp].
+ *
+ *   The pattern is a sequence of segments, each one
+ *   preceded by a '/'. A segment can be a literal, ":d"
+ *   (which matches one or more digits) or ":s" (which
+ *   matches anything other than an empty segment). The
+ *   part of the URL that matched a ":d" or ":s" is
+ *   passed to the callback in [xh_request.captures].
+ *
+ * Returns:
+ *   NULL on success or a description of the error.
+ */
+const char *xh_route(xh_router *router, int methods, const char *pattern, 
+                     xh_callback callback, void *userp)
+{
+	if(pattern[0] != '/')
+		return "Route patterns must start with a '/'";
+
+	if(methods == 0)
+		return "No method was specified for the route";
+
+	route_node_t *node = &router->root;
+	int captures = 0;
+
+	const char *p = pattern;
+	while(*p != '\0')
+	{
+		assert(*p == '/');
+		p += 1; // Skip the '/'.
+
+		const char *label = p;
+		while(*p != '\0' && *p != '/')
+			p += 1;
+		int len = p - label;
+
+		if(len > 0 && label[0] == ':')
 		{
-			case sizeof("HTTP/M.N")-1:
+			if(len != 2 || (label[1] != 'd' && label[1] != 's'))
+				return "Route captures must be \":d\" or \":s\"";
 
-			if(!strcmp(str + version_offset, "HTTP/0.9"))
-			{
-				req->version_major = 0;
-				req->version_minor = 9;
-				break;
-			}
+			if(captures == XH_MAX_CAPTURES)
+				return "Too many captures in route pattern";
+			captures += 1;
 
-			if(!strcmp(str + version_offset, "HTTP/1.0"))
+			route_node_t **slot = (label[1] == 'd') ? &node->number : &node->string;
+			if(*slot == NULL)
 			{
-				req->version_major = 1;
-				req->version_minor = 0;
-				break;
+				*slot = calloc(1, sizeof(route_node_t));
+				if(*slot == NULL)
+					return "Out of memory";
 			}
-
-			if(!strcmp(str + version_offset, "HTTP/1.1"))
+			node = *slot;
+		}
+		else
+		{
+			if(memchr(label, ':', len) != NULL)
+				return "Route captures must span a whole segment";
+
+			bool found;
+			int index = find_child(node, label, len, &found);
+			if(found)
+				node = node->children[index];
+			else
 			{
-				req->version_major = 1;
-				req->version_minor = 1;
-				break;
+				node = add_child(node, index, label, len);
+				if(node == NULL)
+					return "Out of memory";
 			}
+		}
+	}
 
-			if(!strcmp(str + version_offset, "HTTP/2.0"))
-			{
-				req->version_major = 2;
-				req->version_minor = 0;
-				break;
-			}
+	if(node->methods & methods)
+		return "Route already registered";
+
+	route_t *route = malloc(sizeof(route_t));
+	if(route == NULL)
+		return "Out of memory";
+	route->methods  = methods;
+	route->callback = callback;
+	route->userp    = userp;
+	route->next     = node->routes;
+	node->routes    = route;
+	node->methods  |= methods;
+	return NULL;
+}
 
-			if(!strcmp(str + version_offset, "HTTP/3.0"))
-			{
-				req->version_major = 3;
-				req->version_minor = 0;
-				break;
-			}
+static bool all_digits(const char *str, int len)
+{
+	if(len == 0)
+		return 0;
 
-			bad_version = 1;
-			break;
+	for(int i = 0; i < len; i += 1)
+		if(!isdigit((unsigned char) str[i]))
+			return 0;
+	return 1;
+}
 
-			case sizeof("HTTP/M")-1:
+/* Symbol: match_route
+ *
+ *   Match the URL from offset [cur] against the 
+ *   subtrie rooted at [node], storing the captures
+ *   in [req]. The methods of the nodes that match
+ *   the URL are added to [allowed], whether they
+ *   match [method] or not.
+ *
+ * Returns:
+ *   The node with a route for [method] that matched
+ *   the URL, or NULL.
+ */
+static const route_node_t *match_route(const route_node_t *node, xh_request *req, 
+                                       int cur, int method, int *allowed)
+{
+	const char *URL = req->URL.str;
+	int len = req->URL.len;
 
-			if(!strcmp(str + version_offset, "HTTP/1"))
-			{
-				req->version_major = 1;
-				req->version_minor = 0;
-				break;
-			}
+	if(cur == len)
+	{
+		*allowed |= node->methods;
+		return (node->methods & method) ? node : NULL;
+	}
 
-			if(!strcmp(str + version_offset, "HTTP/2"))
-			{
-				req->version_major = 2;
-				req->version_minor = 0;
-				break;
-			}
+	assert(URL[cur] == '/');
+	cur += 1; // Skip the '/'.
+
+	const char *label = URL + cur;
+	while(cur < len && URL[cur] != '/')
+		cur += 1;
+	int label_len = URL + cur - label;
+
+	const route_node_t *found;
+
+	bool is_child;
+	int index = find_child(node, label, label_len, &is_child);
+	if(is_child)
+	{
+		found = match_route(node->children[index], req, cur, method, allowed);
+		if(found != NULL)
+			return found;
+	}
+
+	const route_node_t *captures[] = {
+		all_digits(label, label_len) ? node->number : NULL,
+		label_len > 0 ? node->string : NULL,
+	};
+	for(int i = 0; i < 2; i += 1)
+	{
+		if(captures[i] == NULL)
+			continue;
+
+		int n = req->capture_count;
+		req->captures[n] = (xh_string) { (char*) label, label_len };
+		req->capture_count += 1;
+
+		found = match_route(captures[i], req, cur, method, allowed);
+		if(found != NULL)
+			return found;
+
+		req->capture_count -= 1;
+	}
+	return NULL;
+}
+
+static const char *method_names[] = {
+	"GET", "HEAD", "POST", "PUT", "DELETE",
+	"CONNECT", "OPTIONS", "TRACE", "PATCH",
+};
+
+/* Symbol: respond_method_not_allowed
+ *
+ *   Callback used when a URL matches a route but
+ *   its method doesn't. [userp] holds the methods
+ *   the URL can be requested with.
+ */
+static void respond_method_not_allowed(xh_request *req, xh_response *res, void *userp)
+{
+	(void) req;
+
+	int allowed = (int) (intptr_t) userp;
+	if(allowed & XH_GET)
+		allowed |= XH_HEAD;
+
+	char list[128];
+	int  used = 0;
+	for(int i = 0; i < (int) (sizeof(method_names) / sizeof(method_names[0])); i += 1)
+		if(allowed & (1 << i))
+			used += snprintf(list + used, sizeof(list) - used, 
+			                 "%s%s", used > 0 ? ", " : "", method_names[i]);
+
+	res->status = 405;
+	xh_header_add_string(res, xh_string_from_literal("Allow"), xh_string_new(list, used), XH_COPY);
+}
+
+/* Symbol: route_request
+ *
+ *   Choose the callback for the request being served.
+ *   If a router was configured and one of its routes
+ *   matches the request, its callback is chosen and
+ *   the captures are stored in the request. If a 
+ *   route matches the URL but not the method, the 
+ *   request is refused with a 405 status. Otherwise,
+ *   the callback given to [xhttp] is chosen.
+ */
+static xh_callback route_request(context_t *ctx, xh_request *req, void **userp)
+{
+	req->capture_count = 0;
 
-			if(!strcmp(str + version_offset, "HTTP/3"))
-			{
-				req->version_major = 3;
-				req->version_minor = 0;
-				break;
-			}
+	if(ctx->router != NULL && req->URL.len > 0 && req->URL.str[0] == '/')
+	{
+		// HEAD requests are served by GET routes too.
+		int method = req->method_id;
+		if(method == XH_HEAD)
+			method |= XH_GET;
 
-			bad_version = 1;
-			break;
+		int allowed = 0;
+		const route_node_t *node = match_route(&ctx->router->root, req, 0, method, &allowed);
 
-			default:
-			bad_version = 1;
-			break;
+		if(node != NULL)
+		{
+			route_t *route = node->routes;
+			while((route->methods & method) == 0)
+				route = route->next;
+
+			*userp = route->userp;
+			return route->callback;
 		}
 
-		if(bad_version)
+		req->capture_count = 0;
+
+		if(allowed != 0)
 		{
-			free(headers.list);
-			req->headers.list = NULL;
-			return FAILURE("Bad HTTP version");
+			*userp = (void*) (intptr_t) allowed;
+			return respond_method_not_allowed;
 		}
 	}
 
-	return OK;
-
-	#undef OK
-	#undef FAILURE
-	#undef INTERNAL_FAILURE
+	*userp = ctx->userp;
+	return ctx->callback;
 }
 
-static bool upload(conn_t *conn)
+/* Symbol: response_cache_init
+ *
+ *   Initialize a response cache that holds up to
+ *   [capacity] bytes of responses (0 disables it).
+ *
+ * Returns:
+ *   1 on success, 0 if there's no memory.
+ */
+static bool response_cache_init(response_cache_t *cache, size_t capacity)
 {
-	if(conn->failed_to_append)
+	memset(cache, 0, sizeof(response_cache_t));
+
+	if(capacity == 0)
+		return 1;
+
+	// One chain per KB of capacity should 
+	// keep them short.
+	uint32_t size = 64;
+	while(size < capacity / 1024 && size < (1 << 20))
+		size <<= 1;
+
+	cache->by_key = calloc(size, sizeof(response_entry_t*));
+	if(cache->by_key == NULL)
 		return 0;
+	cache->mask = size - 1;
+	cache->capacity = capacity;
+	return 1;
+}
 
-	
-	if(conn->out.used > 0)
-	{
-		/* Flush the output buffer. */
-		uint32_t sent, total;
+/* Symbol: response_cache_remove
+ *
+ *   Remove an entry from the cache. It's freed once
+ *   no response is using it.
+ */
+static void response_cache_remove(response_cache_t *cache, response_entry_t *entry)
+{
+	assert(entry->cached);
 
-		sent = 0;
-		total = conn->out.used;
+	response_entry_t **link = &cache->by_key[entry->hash & cache->mask];
+	while(*link != entry)
+		link = &(*link)->key_next;
+	*link = entry->key_next;
 
-		if(total == 0)
-			return 1;
+	if(entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
 
-		while(sent < total)
-		{
-			int n = send(conn->fd, conn->out.data + sent, total - sent, 0);
+	if(entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
 
-			if(n < 0)
-			{
-				if(errno == EAGAIN || errno == EWOULDBLOCK)
-					break;
+	cache->used -= entry->size;
+	entry->cached = 0;
 
-				// ERROR!
-				return 0;
-			}
+	if(entry->refs == 0)
+		free(entry);
+}
 
-			assert(n >= 0);
-			sent += n;
-		}
+static void response_cache_free(response_cache_t *cache)
+{
+	while(cache->head != NULL)
+		response_cache_remove(cache, cache->head);
+	free(cache->by_key);
+}
 
-		memmove(conn->out.data, conn->out.data + sent, total - sent);
-		conn->out.used -= sent;
-	}
+/* Symbol: response_entry_release
+ *
+ *   Used as the [xh_response.release] function of
+ *   the bodies sent from the cache.
+ */
+static void response_entry_release(void *body)
+{
+	response_entry_t *entry = (response_entry_t*) body - 1;
 
-	if(conn->sending_from_fd && conn->out.used == 0)
-	{
-		/* Tell the kernel to use sendfile */
-		do
-		{
-			ssize_t n = sendfile(conn->fd, conn->file_fd, NULL, 
-				                 conn->file_len - conn->file_off);
-			
-			if(n < 0)
-			{
-				if(errno == EAGAIN)
-					// Would block, we're done.
-					break;
+	assert(entry->refs > 0);
+	entry->refs -= 1;
 
-				// An error occurred.
-				return 0;
-			}
+	if(entry->refs == 0 && !entry->cached)
+		free(entry);
+}
 
-			conn->file_off += n;
-		}
-		while(conn->file_off < conn->file_len);
+/* Symbol: request_host
+ *
+ *   Get the value of the request's Host header, or
+ *   an empty string if it has none. It's part of 
+ *   the cache key, since the same URL may refer to
+ *   different resources on different hosts.
+ */
+static xh_string request_host(xh_request *req)
+{
+	const char *host = xh_header_get_id(req, XH_HDR_HOST);
+	if(host == NULL)
+		return xh_string_from_literal("");
+	return xh_string_new((char*) host, -1);
+}
 
-		if(conn->file_off == conn->file_len)
-		{
-			// Done sending the file.
-			(void) close(conn->file_fd);
-			conn->sending_from_fd = 0;
-		}
-	}
-	return 1;
+static uint32_t hash_request_key(xh_request *req)
+{
+	xh_string host = request_host(req);
+
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for(int i = 0; i < host.len; i += 1)
+		hash = (hash ^ (unsigned char) host.str[i]) * 16777619u;
+	hash = (hash ^ '\0') * 16777619u;
+	for(int i = 0; i < req->URL.len; i += 1)
+		hash = (hash ^ (unsigned char) req->URL.str[i]) * 16777619u;
+	hash = (hash ^ '?') * 16777619u;
+	for(int i = 0; i < req->params.len; i += 1)
+		hash = (hash ^ (unsigned char) req->params.str[i]) * 16777619u;
+	return hash;
 }
 
-static uint32_t find(const char *str, uint32_t len, const char *seq)
+static bool entry_has_key(response_entry_t *entry, xh_request *req)
 {
-	if(seq == NULL || seq[0] == '\0')
-		return UINT32_MAX;
+	xh_string host = request_host(req);
+	const char *url = entry->key.str + host.len + 1;
+	return entry->key.len == host.len + 1 + req->URL.len + 1 + req->params.len
+	    && !memcmp(entry->key.str, host.str, host.len)
+	    && entry->key.str[host.len] == '\0'
+	    && !memcmp(url, req->URL.str, req->URL.len)
+	    && !memcmp(url + req->URL.len + 1, req->params.str, req->params.len);
+}
 
-	if(str == NULL || len == 0)
-		return UINT32_MAX;
+/* Symbol: next_vary_value
+ *
+ *   Get the value the request has for the header
+ *   named by the next item of a comma-separated
+ *   list, moving [*names] past it. A missing header
+ *   has an empty value.
+ *
+ * Returns:
+ *   1 if there was an item, 0 if the list is over.
+ */
+static bool next_vary_value(xh_request *req, const char **names, xh_string *value)
+{
+	const char *p = *names;
+	while(*p == ',' || is_space(*p))
+		p += 1;
 
-	uint32_t i = 0, seqlen = strlen(seq);
-	while(1)
+	if(*p == '\0')
 	{
-		while(i < len && str[i] != seq[0])
-			i += 1;
+		*names = p;
+		return 0;
+	}
 
-		if(i == len)
-			return UINT32_MAX;
+	const char *name = p;
+	while(*p != '\0' && *p != ',' && !is_space(*p))
+		p += 1;
+	int len = p - name;
+	*names = p;
 
-		assert(str[i] == seq[0]);
+	const char *found;
+	int id = header_id(name, len);
+	if(id >= 0)
+		found = xh_header_get_id(req, id);
+	else
+	{
+		int i = find_header(req->headers, name, len);
+		found = (i < 0) ? NULL : req->headers.list[i].val.str;
+	}
 
-		if(i > len - seqlen)
-			return UINT32_MAX;
+	*value = (found == NULL) ? xh_string_from_literal("") : xh_string_new((char*) found, -1);
+	return 1;
+}
 
-		if(!strncmp(seq, str + i, seqlen))
-			return i;
+/* Symbol: entry_matches_vary
+ *
+ *   Tell whether the request has the same values
+ *   for the vary headers of an entry as the one 
+ *   the entry was stored for.
+ */
+static bool entry_matches_vary(response_entry_t *entry, xh_request *req)
+{
+	const char *names = entry->vary.str;
+	int offset = 0;
 
-		i += 1;
+	xh_string value;
+	while(next_vary_value(req, &names, &value))
+	{
+		if(offset + value.len >= entry->vary_values.len
+			|| memcmp(entry->vary_values.str + offset, value.str, value.len)
+			|| entry->vary_values.str[offset + value.len] != '\0')
+			return 0;
+		offset += value.len + 1;
 	}
+	return 1;
 }
 
-static void append_string_to_output_buffer(conn_t *conn, xh_string data)
+/* Symbol: response_cache_find
+ *
+ *   Find the entry stored for the request's host,
+ *   URL and vary headers, removing the expired ones
+ *   that are found along the way.
+ */
+static response_entry_t *response_cache_find(response_cache_t *cache, xh_request *req, uint32_t hash)
 {
-	if(conn->sending_from_fd)
-		conn->failed_to_append = 1;
-
-	if(conn->failed_to_append)
-		return;
+	uint64_t now = current_time_ms();
 
-	if(conn->out.size - conn->out.used < (uint32_t) data.len)
+	response_entry_t *entry = cache->by_key[hash & cache->mask];
+	while(entry != NULL)
 	{
-		uint32_t new_size = 2 * conn->out.size;
-
-		if(new_size < conn->out.used + (uint32_t) data.len)
-			new_size = conn->out.used + data.len;
-
-		void *temp = realloc(conn->out.data, new_size);
+		response_entry_t *next = entry->key_next;
 
-		if(temp == NULL)
+		if(entry->hash == hash && entry_has_key(entry, req))
 		{
-			conn->failed_to_append = 1;
-			return;
+			if(now >= entry->expire)
+				response_cache_remove(cache, entry);
+			else if(entry_matches_vary(entry, req))
+				return entry;
 		}
-
-		conn->out.data = temp;
-		conn->out.size = new_size;
+		entry = next;
 	}
-
-	memcpy(conn->out.data + conn->out.used, data.str, data.len);
-	conn->out.used += data.len;
-	return;
+	return NULL;
 }
 
-static bool client_wants_to_keep_alive(xh_request *req)
+/* Symbol: response_cache_lookup
+ *
+ *   Find the cached response to the request being
+ *   served, if there is one, and mark it as the most
+ *   recently used. Only GET requests (and HEAD ones,
+ *   which are served as GET requests) are looked up.
+ */
+static response_entry_t *response_cache_lookup(context_t *ctx, xh_request *req)
 {
-	bool keep_alive;
+	response_cache_t *cache = &ctx->responses;
 
-	const char *h_connection = xh_header_get(req, "Connection");
+	if(cache->capacity == 0 || req->method_id != XH_GET || req->body_streamed)
+		return NULL;
 
-	if(h_connection == NULL)
-		// No [Connection] header. No keep-alive.
-		keep_alive = 0;
-	else
+	response_entry_t *entry = response_cache_find(cache, req, hash_request_key(req));
+	if(entry == NULL)
 	{
-		//remove leading spaces
-		h_connection += strspn(h_connection, " ");
-
-		if(!strcasecmp(h_connection, "Keep-Alive"))
-			keep_alive = 1;
-		else /* "Close" or other case */
-			keep_alive = 0;
+		stat_add(&ctx->stats.cache_misses, 1);
+		return NULL;
 	}
+	stat_add(&ctx->stats.cache_hits, 1);
 
-	return keep_alive;
+	if(entry != cache->head)
+	{
+		entry->prev->next = entry->next;
+		if(entry->next != NULL)
+			entry->next->prev = entry->prev;
+		else
+			cache->tail = entry->prev;
+
+		entry->prev = NULL;
+		entry->next = cache->head;
+		cache->head->prev = entry;
+		cache->head = entry;
+	}
+	return entry;
 }
 
-static bool server_wants_to_keep_alive(context_t *ctx, conn_t *conn)
+/* Symbol: response_cache_store
+ *
+ *   Store a copy of the response to the request 
+ *   being served, which must have a string body and
+ *   its Content-Length header. The Connection and
+ *   Date headers are left out, since they're added
+ *   when the response is sent (a Date set by the 
+ *   callback would go stale). If the cache doesn't have 
+ *   enough room, the least recently used entries
+ *   are evicted. Nothing is stored if there's no
+ *   memory.
+ */
+static void response_cache_store(context_t *ctx, xh_request *req, xh_response *res)
 {
-	bool keep_alive;
+	response_cache_t *cache = &ctx->responses;
 
-	if(conn->served >= 20)
-		keep_alive = 0;
+	if(cache->capacity == 0 || req->method_id != XH_GET || req->body_streamed)
+		return;
 
-	if(ctx->connum > 0.6 * ctx->maxconns)
-		keep_alive = 0;
+	xh_string status_line = xh_string_from_literal("");
+	if(res->status >= 100 && res->status < 600)
+		status_line = status_lines[res->status - 100];
+	if(status_line.str == NULL || status_line.len == 0)
+		// Unknown status codes aren't cached.
+		return;
 
-	return keep_alive;
-}
+	const char *vary = res->cache_vary == NULL ? "" : res->cache_vary;
 
-static void append_response_status_line_to_output_buffer(conn_t *conn, int status)
-{
-	char buffer[256];
+	size_t head_len = status_line.len;
+	for(int i = 0; i < res->headers.count; i += 1)
+	{
+		xh_pair header = res->headers.list[i];
+		int id = header_id(header.key.str, header.key.len);
+		if(id != XH_HDR_CONNECTION && id != XH_HDR_DATE)
+			head_len += header.key.len + header.val.len + 4;
+	}
 
-	const char *status_text = statis_code_to_status_text(status);
-	assert(status_text != NULL);
+	size_t vary_len = strlen(vary);
+	size_t values_len = 0;
+	{
+		const char *names = vary;
+		xh_string value;
+		while(next_vary_value(req, &names, &value))
+			values_len += value.len + 1;
+	}
 
-	int n = snprintf(buffer, sizeof(buffer), "HTTP/1.1 %d %s\r\n", 
-		             status, status_text);
-	assert(n >= 0);
+	xh_string host = request_host(req);
+	size_t key_len = host.len + 1 + req->URL.len + 1 + req->params.len;
+	size_t size = sizeof(response_entry_t) + res->body.len + head_len 
+	            + key_len + vary_len + 1 + values_len;
 
-	if((unsigned int) n > sizeof(buffer)-1)
-		n = sizeof(buffer)-1;
+	if(size > cache->capacity)
+		return;
 
-	append_string_to_output_buffer(conn, xh_string_new(buffer, n));
-}
+	uint32_t hash = hash_request_key(req);
 
-static void append_response_head_to_output_buffer(xh_response *res, conn_t *conn)
-{
-	append_response_status_line_to_output_buffer(conn, res->status);
-	for(int i = 0; i < res->headers.count; i += 1)
+	// Replace the entry stored in the meantime for 
+	// the same request, if any.
+	response_entry_t *old = response_cache_find(cache, req, hash);
+	if(old != NULL)
+		response_cache_remove(cache, old);
+
+	while(cache->used + size > cache->capacity)
 	{
-		xh_pair header = res->headers.list[i];
-		append_string_to_output_buffer(conn, header.key);
-		append_string_to_output_buffer(conn, xh_string_from_literal(": "));
-		append_string_to_output_buffer(conn, header.val);
-		append_string_to_output_buffer(conn, xh_string_from_literal("\r\n"));
+		response_cache_remove(cache, cache->tail);
+		stat_add(&ctx->stats.cache_evictions, 1);
 	}
-	append_string_to_output_buffer(conn, xh_string_from_literal("\r\n"));
-}
 
-static enum { 
-	ORF_OK,   ORF_FORBIDDEN, 
-	ORF_NOTFOUND, ORF_OTHER,
-} open_regular_file(const char *file, int *size, int *fd)
-{
-	assert(fd != NULL);
+	response_entry_t *entry = malloc(size);
+	if(entry == NULL)
+		return;
 
-	*fd = open(file, O_RDONLY);
-	if(*fd < 0) {
-		switch(errno) {
-			case EACCES: return ORF_FORBIDDEN;
-			case ENOENT: return ORF_NOTFOUND;
-		}
-		return ORF_OTHER;
+	char *p = (char*) (entry + 1);
+
+	entry->body = (xh_string) { p, res->body.len };
+	memcpy(p, res->body.str, res->body.len);
+	p += res->body.len;
+
+	entry->head = (xh_string) { p, head_len };
+	memcpy(p, status_line.str, status_line.len);
+	p += status_line.len;
+	for(int i = 0; i < res->headers.count; i += 1)
+	{
+		xh_pair header = res->headers.list[i];
+
+		int id = header_id(header.key.str, header.key.len);
+		if(id == XH_HDR_CONNECTION || id == XH_HDR_DATE)
+			continue;
+
+		memcpy(p, header.key.str, header.key.len);
+		p += header.key.len;
+		*p++ = ':';
+		*p++ = ' ';
+		memcpy(p, header.val.str, header.val.len);
+		p += header.val.len;
+		*p++ = '\r';
+		*p++ = '\n';
 	}
 
-	struct stat buf;
+	entry->key = (xh_string) { p, key_len };
+	memcpy(p, host.str, host.len);
+	p[host.len] = '\0';
+	{
+		char *url = p + host.len + 1;
+		memcpy(url, req->URL.str, req->URL.len);
+		url[req->URL.len] = '?';
+		memcpy(url + req->URL.len + 1, req->params.str, req->params.len);
+	}
+	p += key_len;
 
-	if(fstat(*fd, &buf))
-		{ close(*fd); return ORF_OTHER; }
+	entry->vary = (xh_string) { p, vary_len };
+	memcpy(p, vary, vary_len + 1);
+	p += vary_len + 1;
 
-	if(!S_ISREG(buf.st_mode)) // Path doesn't refer to a regular file.
-		{ close(*fd); return ORF_OTHER; }
+	entry->vary_values = (xh_string) { p, values_len };
+	{
+		const char *names = vary;
+		xh_string value;
+		while(next_vary_value(req, &names, &value))
+		{
+			memcpy(p, value.str, value.len);
+			p[value.len] = '\0';
+			p += value.len + 1;
+		}
+	}
+	assert(p == (char*) entry + size);
+
+	entry->hash   = hash;
+	entry->expire = current_time_ms() + 1000 * (uint64_t) res->cache_ttl;
+	entry->size   = size;
+	entry->status = res->status;
+	entry->close  = res->close;
+	entry->refs   = 0;
+	entry->cached = 1;
+
+	entry->key_next = cache->by_key[hash & cache->mask];
+	cache->by_key[hash & cache->mask] = entry;
+
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if(cache->head != NULL)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+	cache->head = entry;
 
-	if(size)
-		*size = buf.st_size;
-	return ORF_OK;
+	cache->used += size;
 }
 
-static void generate_response_by_calling_the_callback(context_t *ctx, conn_t *conn)
+/* Symbol: generate_response_by_calling_the_callback
+ *
+ *   Call [callback] to build the response to the 
+ *   request being served and write it to the output
+ *   buffer. The first time this is called for a 
+ *   request, [callback] is the one given to [xhttp].
+ *   If the response is deferred, it's called again
+ *   with the one given to [xh_respond].
+ *
+ * Returns:
+ *   0 if the callback deferred the response, 1 
+ *   otherwise.
+ */
+static bool generate_response_by_calling_the_callback(context_t *ctx, conn_t *conn, 
+                                                      xh_callback callback, void *userp)
 {
 	xh_request *req = &conn->request.public;
 
-	// If it's a HEAD request, tell the callback that
-	// it's a GET request but then throw awaiy the body.
-	bool head_only = 0;
-	if(req->method_id == XH_HEAD)
+	if(!conn->deferred)
 	{
-		head_only = 1;
-		req->method_id = XH_GET;
-		req->method = xh_string_from_literal("GET");
+		// If it's a HEAD request, tell the callback that
+		// it's a GET request but then throw awaiy the body.
+		conn->head_only = 0;
+		if(req->method_id == XH_HEAD)
+		{
+			conn->head_only = 1;
+			req->method_id = XH_GET;
+			req->method = xh_string_from_literal("GET");
+		}
 	}
+	bool head_only = conn->head_only;
+
+	// If a response to the request is cached, the
+	// callback isn't called at all.
+	response_entry_t *cached = NULL;
+	if(!conn->deferred)
+		cached = response_cache_lookup(ctx, req);
+
+	req->worker = ctx->worker;
 
 	xh_response2 res2;
 	xh_response *res = &res2.public;
 	{
-		res_init(&res2);
+		res_init(&res2, &conn->arena);
+		res2.token = (xh_token) { 
+			.worker = ctx->worker, 
+			.slot   = conn - ctx->pool, 
+			.gen    = conn->gen,
+			.seq    = conn->served,
+		};
 
-		ctx->callback(req, res, ctx->userp);
+		if(cached != NULL)
+		{
+			// The body is sent from the cache entry.
+			cached->refs += 1;
+			res->status  = cached->status;
+			res->body    = cached->body;
+			res->release = response_entry_release;
+			res->close   = cached->close;
+		}
+		else
+			callback(req, res, userp);
 
-		req_deinit(req);
+		if(res2.deferred)
+		{
+			// The response will be provided later through 
+			// [xh_respond]. Anything the callback set is
+			// thrown away.
+			if(res->release != NULL && res->body.str != NULL)
+				res->release(res->body.str);
+			if(res->producer != NULL)
+				res->producer(NULL, 0, res->producer_userp);
+			conn->deferred = 1;
+
+			if(conn->streaming)
+			{
+				conn->stream_callback = res2.stream_callback;
+				conn->stream_userp = res2.stream_userp;
+			}
+			return 0;
+		}
+		conn->deferred = 0;
 
 		if(res2.failed)
 		{
@@ -1227,17 +5005,37 @@ static void generate_response_by_calling_the_callback(context_t *ctx, conn_t *co
 	 * response body  was specified with a  *
 	 * file name, open the file.            */
 
-	int content_length = -1, // Initialized these to shut up 
-	           file_fd = -1; // the compiler :S
+	uint64_t content_length = 0;
+	int      file_fd = -1; // Initialized to shut up the compiler :S
+	file_entry_t *file_entry = NULL;
+	multipart_t  *file_parts = NULL;
+	uint64_t      file_offset = 0;
 
-	bool sending_file;
+	bool sending_file = 0;
 
-	if(res->file == NULL)
+	bool producing = (res->producer != NULL);
+
+	if(producing)
+	{
+		/* The body will be generated while it's sent,
+		   so its length isn't known. */
+		if(res->release != NULL && res->body.str != NULL)
+			res->release(res->body.str);
+		res->release = NULL;
+		content_length = 0;
+		sending_file = 0;
+	}
+	else if(res->file == NULL)
 	{
 		/* The callback specified the 
 		   response body with a string. */
 		if(res->body.str == NULL)
-			res->body.str = "";
+		{
+			// There's nothing to release, and the
+			// literal mustn't be passed to [release].
+			res->body = xh_string_from_literal("");
+			res->release = NULL;
+		}
 
 		if(res->body.len < 0)
 			res->body.len = strlen(res->body.str);
@@ -1250,8 +5048,14 @@ static void generate_response_by_calling_the_callback(context_t *ctx, conn_t *co
 		/* The callback specified the 
 		   response body as a file name. */
 
-		switch(open_regular_file(res->file, 
-			&content_length, &file_fd))
+		// The file takes the place of the body
+		// string, so the string isn't used.
+		if(res->release != NULL && res->body.str != NULL)
+			res->release(res->body.str);
+		res->release = NULL;
+
+		struct stat info;
+		switch(open_file(ctx, res->file, &info, &file_fd, &file_entry))
 		{
 			case ORF_FORBIDDEN:
 			res_reinit(&res2);
@@ -1275,25 +5079,90 @@ static void generate_response_by_calling_the_callback(context_t *ctx, conn_t *co
 			break;
 
 			case ORF_OK:
-			assert(file_fd >= 0 && content_length >= 0);
-			sending_file = 1;
+			{
+				uint64_t length;
+				switch(negotiate_file_response(req, res, &info, &file_offset, &length, &file_parts))
+				{
+					case 1:
+					content_length = length;
+					sending_file = 1;
+					break;
+
+					case 0:
+					// Not modified or the range can't
+					// be satisfied.
+					close_file(ctx, file_fd, file_entry);
+					content_length = 0;
+					sending_file = 0;
+					break;
+
+					default:
+					close_file(ctx, file_fd, file_entry);
+					res_reinit(&res2);
+					res->status = 500;
+					content_length = 0;
+					sending_file = 0;
+					break;
+				}
+				assert(file_fd >= 0);
+			}
 			break;
 
 			/* Don't add a [default] case to make
 			   sure all return codes are handled. */
 		}
+
+		if(!sending_file)
+			// The error responses have no body.
+			res->body = xh_string_from_literal("");
 	}
 
-	assert(content_length >= 0);
+	// If the body of the request is being streamed
+	// and wasn't fully received, the connection can't
+	// be reused since the rest of the body would have
+	// to be read and thrown away.
+	bool body_unread = conn->streaming;
+	conn->streaming = 0;
+	conn->stream_callback = NULL;
 
 	bool callback_wants_to_keep_alive = !res->close;
 	bool keep_alive = client_wants_to_keep_alive(req) 
 	               && server_wants_to_keep_alive(ctx, conn)
-	               && callback_wants_to_keep_alive;
+	               && callback_wants_to_keep_alive
+	               && !body_unread;
+
+	bool chunked = 0;
+	if(producing)
+	{
+		// HTTP/1.0 clients don't know about chunked
+		// encoding, so the end of the body is marked
+		// by closing the connection.
+		if(req->version_major > 1 || (req->version_major == 1 && req->version_minor >= 1))
+		{
+			chunked = 1;
+			header_add(&res2, xh_string_from_literal("Transfer-Encoding"), xh_string_from_literal("chunked"), 0);
+		}
+		else
+			keep_alive = 0;
+	}
+	else if(res->status != 304 && cached == NULL)
+	{
+		// A 304 response could have the length of the
+		// body it refers to, but it's just left out.
+		// Cached responses have it in their head.
+		char digits[20];
+		int  count = format_uint64(digits, content_length);
+		header_add(&res2, xh_string_from_literal("Content-Length"), xh_string_new(digits, count), 1);
+	}
 
-	xh_header_add(res, "Content-Length", "%d", content_length);
-	xh_header_add(res, "Connection", keep_alive ? "Keep-Alive" : "Close");
-	append_response_head_to_output_buffer(res, conn);
+	if(res->cache_ttl > 0 && cached == NULL && !producing && !sending_file && !res2.failed)
+		response_cache_store(ctx, req, res);
+
+	if(keep_alive)
+		header_add(&res2, xh_string_from_literal("Connection"), xh_string_from_literal("Keep-Alive"), 0);
+	else
+		header_add(&res2, xh_string_from_literal("Connection"), xh_string_from_literal("Close"), 0);
+	append_response_head_to_output_buffer(ctx, res, conn, cached);
 
 	/* Now write the body to the output or, if the *
      * request was originally HEAD, throw the body *
@@ -1301,43 +5170,129 @@ static void generate_response_by_calling_the_callback(context_t *ctx, conn_t *co
 
 	if(head_only == 1)
 	{
-		if(sending_file)
-			close(file_fd);
+		if(producing)
+			res->producer(NULL, 0, res->producer_userp);
+		else if(sending_file)
+		{
+			close_file(ctx, file_fd, file_entry);
+			free(file_parts);
+		}
+		else
+			if(res->release != NULL)
+				res->release(res->body.str);
 	}
 	else 
 	{
-		if(sending_file)
+		if(producing)
+		{
+			// The body is generated by [upload] when
+			// the socket can take it.
+			conn->producer = res->producer;
+			conn->producer_userp = res->producer_userp;
+			conn->chunked = chunked;
+		}
+		else if(sending_file)
 		{
 			conn->file_fd = file_fd;
-			conn->file_off = 0;
-			conn->file_len = content_length;
+			conn->file_entry = file_entry;
+			conn->file_off = file_offset;
+			conn->file_len = file_offset + content_length;
 			conn->sending_from_fd = 1;
+
+			if(file_parts != NULL)
+			{
+				// Start from the head of the first part.
+				conn->parts = file_parts;
+				next_part(ctx, conn);
+			}
+		}
+		else if(res->release != NULL)
+		{
+			// The body is owned by the response, so it 
+			// can be sent from where it is and released
+			// later.
+			conn->res_body = res->body;
+			conn->res_body_sent = 0;
+			conn->res_body_release = res->release;
+		}
+		else if(res->body.len >= INLINE_WRITE_THRESHOLD && !conn->failed_to_append)
+		{
+			// The body is only borrowed until the callback
+			// returns, so it must be copied. Since it's big,
+			// try sending it together with the head right
+			// away and only copy what the socket didn't take.
+			long n = flush(conn, res->body.str, res->body.len);
+
+			if(n < 0)
+				// Let [upload] report the error.
+				conn->failed_to_append = 1;
+			else
+				append_string_to_output_buffer(ctx, conn, xh_string_new(res->body.str + n, res->body.len - n));
 		}
-		else append_string_to_output_buffer(conn, res->body);
+		else append_string_to_output_buffer(ctx, conn, res->body);
 	}
 
-	conn->served += 1;
+	conn->served += 1;
+	stat_add(&ctx->stats.requests, 1);
+
+	if(!keep_alive)
+		conn->close_when_uploaded = 1;
+
+	// The response was written to the output buffer,
+	// so everything allocated while serving the request
+	// can be released.
+	req_deinit(req);
+	arena_reset(&conn->arena);
+	return 1;
+}
+
+/* Symbol: determine_content_length
+ *
+ *   Find out how the length of the request's body
+ *   is determined. If the body uses chunked encoding,
+ *   [chunked] is set and 0 is returned.
+ *
+ * Returns:
+ *   The length of the body or UINT64_MAX if it can't
+ *   be determined.
+ */
+static uint64_t determine_content_length(xh_request *req, bool *chunked)
+{
+	*chunked = 0;
+
+	const char *te = xh_header_get_id(req, XH_HDR_TRANSFER_ENCODING);
+	const char *cl = xh_header_get_id(req, XH_HDR_CONTENT_LENGTH);
 
-	if(!keep_alive)
-		conn->close_when_uploaded = 1;
+	if(te != NULL)
+	{
+		// Only chunked encoding is supported. Requests
+		// that also specify a Content-Length are refused,
+		// since something in front of the server may be
+		// using it to determine where the request ends.
+		if(cl != NULL)
+			return UINT64_MAX;
 
-	res_deinit(&res2);
-}
+		const char *s = te;
+		int len = strlen(te);
 
-static uint32_t determine_content_length(xh_request *req)
-{
-	int i;
-	for(i = 0; i < req->headers.count; i += 1)
-		if(!strcasecmp(req->headers.list[i].key.str, 
-		           "Content-Length")) // TODO: Make it case-insensitive.
-			break;
+		while(len > 0 && is_space(s[0]))
+			s += 1, len -= 1;
+		while(len > 0 && is_space(s[len-1]))
+			len -= 1;
 
-	if(i == req->headers.count)
+		if(len != sizeof("chunked")-1 || strncasecmp(s, "chunked", len))
+			return UINT64_MAX;
+
+		*chunked = 1;
+		return 0;
+	}
+
+	if(cl == NULL)
 		// No Content-Length header.
 		// Assume a length of 0.
 		return 0;
 
-	const char *s = req->headers.list[i].val.str;
+	const char *s = cl;
 	unsigned int k = 0;
 
 	while(is_space(s[k]))
@@ -1351,14 +5306,18 @@ static uint32_t determine_content_length(xh_request *req)
 	if(!is_digit(s[k]))
 		// The first non-space character
 		// isn't a digit. That's bad.
-		return UINT32_MAX;
+		return UINT64_MAX;
 
-	uint32_t result = s[k] - '0';
+	uint64_t result = s[k] - '0';
 
 	k += 1;
 
 	while(is_digit(s[k]))
 	{
+		if(result > (UINT64_MAX - 9) / 10)
+			// Too big.
+			return UINT64_MAX;
+
 		result = result * 10 + s[k] - '0';
 		k += 1;
 	}
@@ -1369,47 +5328,252 @@ static uint32_t determine_content_length(xh_request *req)
 	if(s[k] != '\0')
 		// The header contains something other
 		// than whitespace and digits. Bad.
-		return UINT32_MAX;
+		return UINT64_MAX;
 
 	return result;
 }
 
+static void serve_buffered_requests(context_t *ctx, conn_t *conn);
+
+/* Symbol: decode_chunks
+ *
+ *   Decode what arrived of the chunked body of the
+ *   request being served and remove the framing from
+ *   the input buffer.
+ *
+ * Returns:
+ *   An error message if the body is malformed or
+ *   NULL.
+ */
+static const char *decode_chunks(context_t *ctx, conn_t *conn)
+{
+	buffer_t *b = &conn->in;
+	char *body = b->data + b->head + conn->body_offset;
+	uint32_t len = buffer_count(b) - conn->body_offset;
+
+	const char *error;
+	uint32_t consumed = dechunk(&conn->dechunker, body, len, &conn->body_length, 
+	                            ctx->max_body_chunks, &error);
+
+	// Move what follows the consumed bytes back over
+	// the framing that was removed.
+	memmove(body + conn->body_length, body + consumed, len - consumed);
+	b->used -= consumed - conn->body_length;
+	return error;
+}
+
+/* Symbol: stream_body
+ *
+ *   Pass the body bytes that are in the input buffer
+ *   to the callback that's reading the body of the
+ *   request being served, then remove them from the
+ *   buffer. Whatever follows the body is moved back
+ *   to where the body started.
+ */
+static void stream_body(context_t *ctx, conn_t *conn)
+{
+	buffer_t *b = &conn->in;
+	char *base = b->data + b->head;
+
+	while(conn->streaming && conn->stream_callback != NULL && !conn->paused)
+	{
+		uint32_t avail = buffer_count(b) - conn->body_offset;
+
+		uint32_t n;
+		bool  last;
+		if(conn->dechunker.active)
+		{
+			// Only the decoded part of a chunked
+			// body can be passed on.
+			if(decode_chunks(ctx, conn) != NULL)
+			{
+				// The body is malformed. Since the callback
+				// is handling the request, no error response
+				// can be sent.
+				close_connection(ctx, conn);
+				return;
+			}
+			avail = buffer_count(b) - conn->body_offset;
+
+			n = conn->body_length;
+			if(n > ctx->max_buffered_body)
+				n = ctx->max_buffered_body;
+			last = conn->dechunker.state == CHUNK_DONE && n == conn->body_length;
+		}
+		else
+		{
+			n = avail;
+			if(n > conn->body_left)
+				n = conn->body_left;
+			if(n > ctx->max_buffered_body)
+				n = ctx->max_buffered_body;
+			last = (n == conn->body_left);
+		}
+
+		if(n == 0 && !last)
+			break;
+
+		bool more = conn->stream_callback(xh_string_new(base + conn->body_offset, n), 
+		                                  last, conn->stream_userp);
+
+		memmove(base + conn->body_offset, base + conn->body_offset + n, avail - n);
+		b->used -= n;
+		if(conn->dechunker.active)
+			conn->body_length -= n;
+		else
+			conn->body_left -= n;
+
+		if(last)
+		{
+			// Now the request is just the head, like
+			// one without a body.
+			conn->streaming = 0;
+			conn->stream_callback = NULL;
+			conn->byte_after_body = base[conn->body_offset];
+			break;
+		}
+
+		if(!more)
+			conn->paused = 1;
+	}
+}
+
+/* Symbol: remove_served_request
+ *
+ *   Remove the request that was just served from
+ *   the input buffer, so that the next one can be
+ *   parsed.
+ */
+static void remove_served_request(conn_t *conn)
+{
+	char *base = conn->in.data + conn->in.head;
+
+	// The body was made zero-terminated by overwriting
+	// the byte that comes after it. Put it back.
+	base[conn->body_offset + conn->body_length] = conn->byte_after_body;
+
+	buffer_consume(&conn->in, conn->body_offset + conn->body_length);
+	conn->head_received = 0;
+	memset(&conn->parser, 0, sizeof(parser_t));
+	memset(&conn->dechunker, 0, sizeof(dechunker_t));
+}
+
+/* Symbol: reply_and_close
+ *
+ *   Respond to the request being served with an 
+ *   error without involving the callback, then 
+ *   close the connection once it's sent.
+ */
+static void reply_and_close(context_t *ctx, conn_t *conn, int status, const char *msg)
+{
+	xh_string status_line = status_lines[status - 100];
+	assert(status_line.str != NULL);
+
+	char buffer[512];
+	(void) snprintf(buffer, sizeof(buffer),
+		"%s%s"
+		"Content-Type: text/plain;charset=utf-8\r\n"
+		"Content-Length: %d\r\n"
+		"Connection: Close\r\n"
+		"\r\n%s", status_line.str, ctx->date_line, (int) strlen(msg), msg);
+
+	// NOTE: If the static buffer [buffer] is too small
+	//       to hold the response then the response will
+	//       be sent truncated. But that's not a problem
+	//       since we'll close the connection after this
+	//       response either way.
+
+	append_string_to_output_buffer(ctx, conn, xh_string_new(buffer, -1));
+	conn->close_when_uploaded = 1;
+}
+
+/* Symbol: wants_to_read
+ *
+ *   Tells whether data should be read from the
+ *   connection's socket. When it shouldn't, the 
+ *   data is left in the kernel's buffer and read
+ *   explicitly when the connection is ready for it,
+ *   since no new event will be reported for it.
+ */
+static bool wants_to_read(conn_t *conn)
+{
+	if(conn->close_when_uploaded)
+		return 0;
+
+	if(conn->deferred)
+		// Only read while the callback is consuming
+		// the body of the request.
+		return conn->streaming && conn->stream_callback != NULL && !conn->paused;
+
+	return 1;
+}
+
+#define CHUNK_FRAMING_ROOM 4096
+
 static void when_data_is_ready_to_be_read(context_t *ctx, conn_t *conn)
 {
-	// Download the data in the input buffer.
-	uint32_t downloaded;
+	uint32_t received = 0;
+	bool full;
+
+	conn->input_full = 0;
+	conn->read_throttled = 0;
+	do
 	{
+		// Download the data in the input buffer. When a body
+		// is being streamed, no more than [max_buffered_body]
+		// bytes of it are buffered at the time. While the 
+		// head is incomplete, one byte over [max_head_size]
+		// is enough to know it's too long.
+		uint32_t limit = UINT32_MAX;
+		if(!conn->head_received)
+			limit = ctx->max_head_size + 1;
+		else if(conn->streaming)
+			limit = conn->body_offset + ctx->max_buffered_body;
+		else if(conn->dechunker.active)
+			// Leave room for the framing, so that the 
+			// end of a body of [max_buffered_body] bytes
+			// can be decoded.
+			limit = conn->body_offset + ctx->max_buffered_body + CHUNK_FRAMING_ROOM;
+
 		buffer_t *b = &conn->in;
-		uint32_t before = b->used;
+		full = 0;
 		while(1)
 		{
-			if(b->size - b->used < 128)
+			if(buffer_count(b) >= limit)
+			{
+				full = 1;
+				break;
+			}
+
+			if(ctx->read_budget > 0 && received >= ctx->read_budget)
 			{
-				uint32_t new_size = (b->size == 0) ? 512 : (2 * b->size);
+				// Leave the rest for the connection's 
+				// next turn.
+				conn->read_throttled = 1;
+				break;
+			}
 
-				// NOTE: We allocate one extra byte because this
-				//       way we're sure that any sub-string of the
-				//       buffer can be safely made zero-terminated
-				//       by writing a zero after it temporarily.
-				void *temp = realloc(b->data, new_size + 1);
+			if(b->size - b->used < 128)
+			{
+				// Pointers to the contents of the buffer
+				// need to be updated if they're moved.
+				char *old_base = b->data + b->head;
 
-				if(temp == NULL)
+				if(!buffer_reserve(&ctx->buffers, b, 128))
 				{
 					// ERROR!
 					close_connection(ctx, conn);
 					return;
 				}
 
-				// TODO: Change the pointers in conn->request
-				//       if the head was already parsed.
-
-				b->data = temp;
-				b->size = new_size;
+				if(conn->head_received && old_base != b->data)
+					rebase_request(&conn->request.public, old_base, b->data);
 			}
 
 			assert(b->size > b->used);
 
-			int n = recv(conn->fd, b->data + b->used, b->size - b->used, 0);
+			uint32_t space = b->size - b->used;
+			int n = recv(conn->fd, b->data + b->used, space, 0);
 
 			if(n <= 0)
 			{
@@ -1432,89 +5596,220 @@ static void when_data_is_ready_to_be_read(context_t *ctx, conn_t *conn)
 			}
 
 			b->used += n;
+			received += n;
+
+			// A read that didn't fill the buffer took all
+			// the socket had, so another one would only fail
+			// with EAGAIN. Since the socket is edge-triggered,
+			// data arriving after this point is reported by
+			// a new event.
+			if((uint32_t) n < space)
+				break;
 		}
-		downloaded = b->used - before;
-	}
 
-	int served_during_this_while_loop = 0;
+		uint32_t count = buffer_count(b);
+		bool head_received = conn->head_received;
+
+		// Note that this may close the connection.
+		serve_buffered_requests(ctx, conn);
+		if(conn->fd < 0)
+			return;
+
+		if(full && (conn->serve_throttled || (count == buffer_count(b)
+			&& head_received == conn->head_received)))
+		{
+			// Serving didn't make room, which happens when
+			// the requests are pipelined behind a response
+			// that's still being sent, or it was throttled.
+			// Reading again would only hit the limit, so it's
+			// resumed when the response is done or in the
+			// connection's next turn.
+			conn->input_full = 1;
+			break;
+		}
+	}
+	// If the download stopped because the buffer was
+	// full, there may be more data to read now that
+	// it was consumed.
+	while(full && !conn->read_throttled && wants_to_read(conn));
+}
 
+/* Symbol: serve_buffered_requests
+ *
+ *   Serve the requests in the input buffer until one
+ *   is found that wasn't completely received, the
+ *   last response can't be written to the output 
+ *   buffer yet or the connection served [request_budget]
+ *   requests in its turn.
+ */
+static void serve_buffered_requests(context_t *ctx, conn_t *conn)
+{
+	conn->serve_throttled = 0;
 	while(1)
 	{
-		if(!conn->head_received)
-		{
-			// Search for an \r\n\r\n.
-			uint32_t i;
-			{
-				uint32_t start = 0;
-				if(served_during_this_while_loop == 0 && conn->in.used > downloaded + 3)
-					start = conn->in.used - downloaded - 3;
+		if(response_in_progress(conn))
+			// The body of the last response is still being
+			// sent. The following ones will be served when 
+			// it's done.
+			break;
 
-				i = find(conn->in.data + start, conn->in.used - start, "\r\n\r\n");
+		if(conn->deferred)
+		{
+			// The callback didn't provide the response to
+			// the last request yet. If it's reading the
+			// body, give it what arrived.
+			if(conn->streaming)
+				stream_body(ctx, conn);
+			break;
+		}
 
-				if(i == UINT32_MAX)
-					// No \r\n\r\n found. The head of the request wasn't fully received yet.
-					return;
+		if(!conn->head_received && buffer_count(&conn->in) > 0
+			&& ctx->request_budget > 0 && conn->turn_requests >= ctx->request_budget)
+		{
+			// The following requests will be served
+			// in the connection's next turn.
+			conn->serve_throttled = 1;
+			break;
+		}
 
-				// i is relative to start.
-				i += start;
-			}
+		// The request being served starts here. All
+		// offsets in the following code are relative
+		// to this pointer.
+		char *base = conn->in.data + conn->in.head;
 
-			struct parse_err_t err = parse(conn->in.data, i+4, &conn->request.public);
+		if(!conn->head_received)
+		{
+			// Feed the bytes that arrived since the last
+			// call to the parser.
+			struct parse_err_t err = parse(&conn->parser, base, buffer_count(&conn->in), 
+			                               &conn->request, &conn->arena);
 
-			uint32_t len = 0; // Anything other than UINT32_MAX goes.
 			if(err.msg == NULL)
-				len = determine_content_length(&conn->request.public); // Returns UINT32_MAX on failure.
-
-			if(err.msg != NULL || len == UINT32_MAX)
 			{
-				char buffer[512];
-				if(len == UINT32_MAX)
+				// A single read may bring in more than the
+				// limit, so complete heads are checked too.
+				bool done = (conn->parser.state == PARSE_DONE);
+				uint32_t head_size = done ? conn->parser.cur : buffer_count(&conn->in);
+				if(head_size > ctx->max_head_size)
 				{
-					static const char msg[] = "Couldn't determine the content length";
+					static const char msg[] = "Request head too big";
+					char buffer[256];
 					(void) snprintf(buffer, sizeof(buffer),
-						"HTTP/1.1 400 Bad Request\r\n"
+						"HTTP/1.1 431 Request Header Fields Too Large\r\n"
 						"Content-Type: text/plain;charset=utf-8\r\n"
 						"Content-Length: %ld\r\n"
 						"Connection: Close\r\n"
 						"\r\n%s", sizeof(msg)-1, msg);
+					append_string_to_output_buffer(ctx, conn, xh_string_new(buffer, -1));
+					conn->close_when_uploaded = 1;
+					return;
 				}
-				else if(err.internal)
-				{
-					(void) snprintf(buffer, sizeof(buffer),
-						"HTTP/1.1 500 Internal Server Error\r\n"
-						"Content-Type: text/plain;charset=utf-8\r\n"
-						"Content-Length: %d\r\n"
-						"Connection: Close\r\n"
-						"\r\n%s", err.len, err.msg);
-				}
-				else
-				{
-					// 400 Bad Request.
-					(void) snprintf(buffer, sizeof(buffer),
-						"HTTP/1.1 400 Bad Request\r\n"
-						"Content-Type: text/plain;charset=utf-8\r\n"
-						"Content-Length: %d\r\n"
-						"Connection: Close\r\n"
-						"\r\n%s", err.len, err.msg);
-				}
 
-				// NOTE: If the static buffer [buffer] is too small
-				//       to hold the response then the response will
-				//       be sent truncated. But that's not a problem
-				//       since we'll close the connection after this
-				//       response either way.
+				if(!done)
+					// The head of the request wasn't fully received yet.
+					return;
+			}
+
+			uint64_t len = 0; // Anything other than UINT64_MAX goes.
+			bool chunked = 0;
+			if(err.msg == NULL)
+				len = determine_content_length(&conn->request.public, &chunked); // Returns UINT64_MAX on failure.
+
+			bool too_big = len != UINT64_MAX && len > ctx->max_buffered_body && !ctx->stream_bodies;
 
-				append_string_to_output_buffer(conn, xh_string_new(buffer, -1));
-				conn->close_when_uploaded = 1;
+			if(err.msg != NULL || len == UINT64_MAX || too_big)
+			{
+				if(len == UINT64_MAX)
+					reply_and_close(ctx, conn, 400, "Couldn't determine the content length");
+				else if(too_big)
+					reply_and_close(ctx, conn, 413, "Request body too big");
+				else
+					reply_and_close(ctx, conn, err.internal ? 500 : 400, err.msg);
 				return;
 			}
 
 			conn->head_received = 1;
-			conn->body_offset = i + 4;
-			conn->body_length = len;
+			conn->body_offset = conn->parser.cur;
+
+			if(chunked)
+			{
+				// The body is decoded as it arrives. Its
+				// length is only known after the last chunk.
+				memset(&conn->dechunker, 0, sizeof(dechunker_t));
+				conn->dechunker.active = 1;
+				conn->body_length = 0;
+			}
+			else if(len > ctx->max_buffered_body)
+			{
+				// The body is too big to be buffered, so it's
+				// passed to the callback as it arrives.
+				conn->body_length = 0;
+				conn->body_left = len;
+				conn->streaming = 1;
+				conn->paused = 0;
+			}
+			else
+				conn->body_length = len;
+		}
+
+		if(conn->head_received && conn->dechunker.active && !conn->streaming)
+		{
+			const char *error = decode_chunks(ctx, conn);
+			bool too_big = conn->body_length > ctx->max_buffered_body;
+
+			if(error != NULL)
+			{
+				reply_and_close(ctx, conn, 400, error);
+				return;
+			}
+
+			if(too_big && !ctx->stream_bodies)
+			{
+				reply_and_close(ctx, conn, 413, "Request body too big");
+				return;
+			}
+
+			if(too_big)
+			{
+				// From now on the body is passed to the
+				// callback as it's decoded.
+				conn->streaming = 1;
+				conn->paused = 0;
+			}
+			else if(conn->dechunker.state != CHUNK_DONE)
+				// The rest of the body wasn't received yet.
+				break;
+		}
+
+		if(conn->head_received && conn->streaming)
+		{
+			/* Let the callback know about the request before
+			 * the body is received. It can read the body with
+			 * [xh_stream], which also defers the response.  */
+
+			conn->byte_after_body = base[conn->body_offset];
+
+			xh_request *req = &conn->request.public;
+			req->body = xh_string_from_literal("");
+			req->body_streamed = 1;
+			conn->turn_requests += 1;
+
+			void *userp;
+			xh_callback callback = route_request(ctx, req, &userp);
+
+			if(generate_response_by_calling_the_callback(ctx, conn, callback, userp))
+			{
+				// Responded without reading the body, so the
+				// connection will be closed.
+				remove_served_request(conn);
+				break;
+			}
+
+			stream_body(ctx, conn);
+			break;
 		}
 
-		if(conn->head_received && conn->body_offset + conn->body_length <= conn->in.used)
+		if(conn->head_received && conn->body_offset + conn->body_length <= buffer_count(&conn->in))
 		{
 			/* The rest of the body arrived. */
 
@@ -1523,43 +5818,257 @@ static void when_data_is_ready_to_be_read(context_t *ctx, conn_t *conn)
 			// When you don't need it to be zero-terminated anymore,
 			// put the saved byte back in.
 
-			char first_byte_after_body_in_input_buffer 
-				= conn->in.data[conn->body_offset + conn->body_length];
+			conn->byte_after_body = base[conn->body_offset + conn->body_length];
 
-			conn->in.data[conn->body_offset + conn->body_length] = '\0';
+			base[conn->body_offset + conn->body_length] = '\0';
 
 			xh_request *req = &conn->request.public;
-			req->body = xh_string_new(conn->in.data + conn->body_offset, conn->body_length);
+			req->body = xh_string_new(base + conn->body_offset, conn->body_length);
+			req->body_streamed = 0;
+			conn->turn_requests += 1;
 
-			generate_response_by_calling_the_callback(ctx, conn);
+			void *userp;
+			xh_callback callback = route_request(ctx, req, &userp);
 
-			// Restore the byte after the body.
-			conn->in.data[conn->body_offset + conn->body_length] 
-				= first_byte_after_body_in_input_buffer;
-
-			// Remove the request from the input buffer by
-			// copying back its remaining contents.
-			uint32_t consumed = conn->body_offset + conn->body_length;
-			memmove(conn->in.data, conn->in.data + consumed, conn->in.used - consumed);
-			conn->in.used -= consumed;
-			conn->head_received = 0;
+			if(!generate_response_by_calling_the_callback(ctx, conn, callback, userp))
+				// The response was deferred. The request must
+				// stay in the input buffer until it's completed,
+				// and the following ones must wait for it.
+				break;
 
-			served_during_this_while_loop += 1;
+			remove_served_request(conn);
 
 			if(conn->close_when_uploaded)
 				break;
 		}
+		else
+			// The rest of the body wasn't received yet.
+			break;
+	}
+}
+
+/* Symbol: queue_completion
+ *
+ *   Queue a completion for the worker that owns the
+ *   connection identified by [token] and wake it up.
+ *   A NULL [callback] resumes a paused body stream.
+ */
+static bool queue_completion(xh_handle handle, xh_token token, 
+                             xh_callback callback, void *userp)
+{
+	server_t *server = handle;
+
+	assert(token.worker < server->count);
+	context_t *ctx = server->workers + token.worker;
+
+	pthread_mutex_lock(&ctx->completions_lock);
+
+	if(ctx->completions_count == ctx->completions_capacity)
+	{
+		int new_capacity = ctx->completions_capacity == 0 ? 8 : 2 * ctx->completions_capacity;
+
+		void *temp = realloc(ctx->completions, new_capacity * sizeof(completion_t));
+		if(temp == NULL)
+		{
+			pthread_mutex_unlock(&ctx->completions_lock);
+			return 0;
+		}
+
+		ctx->completions = temp;
+		ctx->completions_capacity = new_capacity;
+	}
+
+	ctx->completions[ctx->completions_count++] = (completion_t) {
+		.slot = token.slot, .gen = token.gen, .seq = token.seq,
+		.callback = callback, .userp = userp,
+	};
+
+	pthread_mutex_unlock(&ctx->completions_lock);
+
+	uint64_t one = 1;
+	(void) write(ctx->wakefd, &one, sizeof(one));
+	return 1;
+}
+
+/* Symbol: xh_defer
+ *
+ *   Tell the server that the callback won't provide
+ *   the response before returning. The connection is
+ *   put on hold (the requests that follow on it wait)
+ *   until the response is completed with [xh_respond] 
+ *   using the returned token. Anything set on [res] 
+ *   is ignored.
+ *
+ *   The request stays valid until the response is
+ *   completed. If that takes more than [write_timeout]
+ *   seconds, the connection is closed.
+ *
+ * Arguments:
+ *
+ *   - res: The response passed to the callback.
+ *
+ * Notes:
+ *   - This must be called from the callback.
+ */
+xh_token xh_defer(xh_response *res)
+{
+	xh_response2 *res2 = (xh_response2*) ((char*) res - offsetof(xh_response2, public));
+
+	assert(&res2->public == res);
+
+	res2->deferred = 1;
+	return res2->token;
+}
+
+/* Symbol: xh_respond
+ *
+ *   Complete a deferred response. The worker that
+ *   received the request will call [callback] with
+ *   the original request and a new response, just 
+ *   like the callback given to [xhttp] (which means
+ *   it can also defer the response again).
+ *
+ *   If the connection was closed in the meantime,
+ *   [callback] is called with NULL request and 
+ *   response, so that [userp] can be released.
+ *
+ * Arguments:
+ *
+ *   - handle: The handle returned by [xhttp].
+ *
+ *   - token: The token returned by [xh_defer].
+ *
+ * Returns:
+ *   1 if the completion was queued, 0 if it 
+ *   couldn't be (out of memory).
+ *
+ * Notes:
+ *   - This function is safe to call from any thread,
+ *     including the workers' ones.
+ */
+_Bool xh_respond(xh_handle handle, xh_token token, 
+                 xh_callback callback, void *userp)
+{
+	assert(callback != NULL);
+	return queue_completion(handle, token, callback, userp);
+}
+
+/* Symbol: xh_stream
+ *
+ *   Read the body of a request that has [body_streamed]
+ *   set. The body is passed to [callback] in chunks as
+ *   it arrives, then the response must be provided 
+ *   with [xh_respond] like when calling [xh_defer], 
+ *   using the returned token.
+ *
+ *   If the response is provided before the whole body
+ *   was read, the connection is closed after it's sent.
+ *   The same happens if the callback responds without
+ *   calling this function.
+ *
+ * Arguments:
+ *
+ *   - res: The response passed to the callback.
+ *
+ * Notes:
+ *   - This must be called from the callback.
+ */
+xh_token xh_stream(xh_response *res, xh_body_callback callback, void *userp)
+{
+	xh_response2 *res2 = (xh_response2*) ((char*) res - offsetof(xh_response2, public));
+
+	assert(&res2->public == res);
+
+	res2->stream_callback = callback;
+	res2->stream_userp = userp;
+	return xh_defer(res);
+}
+
+/* Symbol: xh_resume
+ *
+ *   Resume the delivery of a streamed body after 
+ *   the body callback returned 0.
+ *
+ * Returns:
+ *   1 if the request was queued, 0 if it couldn't
+ *   be (out of memory).
+ *
+ * Notes:
+ *   - This function is safe to call from any thread.
+ */
+_Bool xh_resume(xh_handle handle, xh_token token)
+{
+	return queue_completion(handle, token, NULL, NULL);
+}
+
+
+/* Symbol: xh_get_stats
+ *
+ *   Get the counters of a running server instance,
+ *   summed over all of its workers. The counters 
+ *   are updated while the snapshot is taken, so they
+ *   may be slightly out of sync with each other.
+ *
+ * Arguments:
+ *
+ *   - handle: The handle returned by [xhttp].
+ *
+ * Notes:
+ *   - This function is safe to call from any thread.
+ */
+xh_stats xh_get_stats(xh_handle handle)
+{
+	server_t *server = handle;
+	xh_stats stats = {0};
+
+	for(unsigned int i = 0; i < server->count; i += 1)
+	{
+		context_t *ctx = server->workers + i;
+		stats.wakeups     += atomic_load_explicit(&ctx->stats.wakeups,     memory_order_relaxed);
+		stats.events      += atomic_load_explicit(&ctx->stats.events,      memory_order_relaxed);
+		stats.requests    += atomic_load_explicit(&ctx->stats.requests,    memory_order_relaxed);
+		stats.connections += atomic_load_explicit(&ctx->stats.connections, memory_order_relaxed);
+		stats.write_waits += atomic_load_explicit(&ctx->stats.write_waits, memory_order_relaxed);
+		stats.cache_hits      += atomic_load_explicit(&ctx->stats.cache_hits,      memory_order_relaxed);
+		stats.cache_misses    += atomic_load_explicit(&ctx->stats.cache_misses,    memory_order_relaxed);
+		stats.cache_evictions += atomic_load_explicit(&ctx->stats.cache_evictions, memory_order_relaxed);
 	}
+	return stats;
 }
 
+/* Symbol: xh_quit
+ *
+ *   Ask all workers of a server instance to stop.
+ *   The call to [xhttp] that started the server
+ *   returns once every worker exited.
+ *
+ * Arguments:
+ *
+ *   - handle: The handle returned by [xhttp].
+ *
+ * Notes:
+ *   - This function is safe to call from a 
+ *     signal handler or from any thread.
+ */
 void xh_quit(xh_handle handle)
 {
-	context_t *ctx = handle;
-	ctx->exiting = 1;
+	server_t *server = handle;
+
+	for(unsigned int i = 0; i < server->count; i += 1)
+	{
+		context_t *ctx = server->workers + i;
+		ctx->exiting = 1;
+
+		// Wake up the worker in case it's
+		// blocked waiting for events.
+		uint64_t one = 1;
+		(void) write(ctx->wakefd, &one, sizeof(one));
+	}
 }
 
 static const char *init(context_t *context, const char *addr, 
-	                    unsigned short port, const xh_config *config)
+	                    unsigned short port, const xh_config *config,
+	                    bool reuse_port)
 {
 	if(config->maximum_parallel_connections == 0)
 		return "The number of maximum parallel connections isn't allowed to be 0";
@@ -1567,8 +6076,31 @@ static const char *init(context_t *context, const char *addr,
 	if(config->backlog == 0)
 		return "The backlog isn't allowed to be 0";
 
+	if(config->buffer_size < 128)
+		return "The buffer size isn't allowed to be less than 128";
+
+	if(config->buffer_classes == 0 || config->buffer_classes > MAX_BUFFER_CLASSES)
+		return "The number of buffer classes must be between 1 and 16";
+
+	if((uint64_t) config->buffer_size << (config->buffer_classes-1) > UINT32_MAX / 2)
+		return "The biggest buffer class is too big";
+
+	if(config->max_buffered_body == 0 || config->max_buffered_body > UINT32_MAX / 4)
+		return "The maximum buffered body size must be between 1 and 1GB";
+
+	if(config->accept_budget == 0)
+		return "The accept budget isn't allowed to be 0";
+
+	if(config->max_head_size == 0 || config->max_head_size > UINT32_MAX / 4)
+		return "The maximum head size must be between 1 and 1GB";
+
+	if(config->keep_alive_threshold > 100)
+		return "The keep-alive threshold is a percentage and can't be over 100";
+
 	{
-		context->fd = socket(AF_INET, SOCK_STREAM, 0);
+		// The listener is non-blocking so that the
+		// accept loop can stop when the queue is empty.
+		context->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
 		if(context->fd < 0)
 			return "Failed to create socket";
@@ -1584,6 +6116,35 @@ static const char *init(context_t *context, const char *addr,
 			}
 		}
 
+		if(reuse_port)
+		{
+			// Let the other workers bind to the same
+			// address so that the kernel can distribute
+			// incoming connections between them.
+			int v = 1;
+			if(setsockopt(context->fd, SOL_SOCKET,
+						  SO_REUSEPORT, &v, sizeof(v)))
+			{
+				(void) close(context->fd);
+				return "Failed to set socket option";
+			}
+		}
+
+		if(config->defer_accept > 0)
+		{
+			// Only report connections once they sent
+			// some data (or after [defer_accept] seconds),
+			// so that the first read doesn't need its own
+			// wakeup.
+			int v = config->defer_accept;
+			if(setsockopt(context->fd, IPPROTO_TCP,
+						  TCP_DEFER_ACCEPT, &v, sizeof(v)))
+			{
+				(void) close(context->fd);
+				return "Failed to set socket option";
+			}
+		}
+
 		struct in_addr inp;
 		if(addr == NULL)
 			inp.s_addr = INADDR_ANY;
@@ -1637,6 +6198,33 @@ static const char *init(context_t *context, const char *addr,
 		}
 	}
 
+	{
+		context->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if(context->wakefd < 0)
+		{
+			(void) close(context->fd);
+			(void) close(context->epfd);
+			return "Failed to create eventfd";
+		}
+
+		// The wake-up events are told apart from
+		// the others by having the context as the
+		// associated pointer.
+		struct epoll_event temp;
+
+		temp.events = EPOLLIN;
+		temp.data.ptr = context;
+
+		if(epoll_ctl(context->epfd, EPOLL_CTL_ADD, context->wakefd, &temp))
+		{
+			(void) close(context->fd);
+			(void) close(context->epfd);
+			(void) close(context->wakefd);
+			return "Failed to add eventfd to epoll";
+		}
+	}
+
 	{
 		context->pool = malloc(config->maximum_parallel_connections * sizeof(conn_t));
 
@@ -1644,12 +6232,14 @@ static const char *init(context_t *context, const char *addr,
 		{
 			(void) close(context->fd);
 			(void) close(context->epfd);
+			(void) close(context->wakefd);
 			return "Failed to allocate connection pool";
 		}
 
 		for(unsigned int i = 0; i < config->maximum_parallel_connections; i += 1)
 		{
 			context->pool[i].fd = -1;
+			context->pool[i].gen = 0;
 			context->pool[i].next = context->pool + i + 1;
 		}
 
@@ -1658,54 +6248,458 @@ static const char *init(context_t *context, const char *addr,
 		context->freelist = context->pool;
 	}
 
+	if(!file_cache_init(&context->files, config->file_cache_size, config->file_cache_ttl))
+	{
+		(void) close(context->fd);
+		(void) close(context->epfd);
+		(void) close(context->wakefd);
+		free(context->pool);
+		return "Failed to allocate file cache";
+	}
+
+	if(!response_cache_init(&context->responses, config->response_cache_size))
+	{
+		file_cache_free(&context->files);
+		(void) close(context->fd);
+		(void) close(context->epfd);
+		(void) close(context->wakefd);
+		free(context->pool);
+		return "Failed to allocate response cache";
+	}
+
+	// The inotify events are told apart from the
+	// others by having the cache as the associated
+	// pointer. If they can't be monitored, cached
+	// files expire instead.
+	if(context->files.inotify >= 0)
+	{
+		struct epoll_event temp;
+
+		temp.events = EPOLLIN;
+		temp.data.ptr = &context->files;
+
+		if(epoll_ctl(context->epfd, EPOLL_CTL_ADD, context->files.inotify, &temp))
+		{
+			(void) close(context->files.inotify);
+			context->files.inotify = -1;
+		}
+	}
+
+	memset(&context->buffers, 0, sizeof(buffer_pool_t));
+	context->buffers.base = config->buffer_size;
+	context->buffers.classes = config->buffer_classes;
+	context->buffers.budget = config->buffer_pool_budget;
+	context->max_head_size = config->max_head_size;
+
+	context->keep_alive_max_requests = config->keep_alive_max_requests;
+	context->keep_alive_timeout = config->keep_alive_timeout;
+	context->keep_alive_threshold = config->keep_alive_threshold;
+	context->accept_budget = config->accept_budget;
+	context->max_buffered_body = config->max_buffered_body;
+	context->stream_bodies = config->stream_bodies;
+	context->max_body_chunks = config->max_body_chunks;
+	context->sendfile_budget = config->sendfile_budget;
+	context->read_budget = config->read_budget;
+	context->request_budget = config->request_budget;
+	context->router = config->router;
+	context->header_timeout = config->header_timeout;
+	context->body_timeout = config->body_timeout;
+	context->write_timeout = config->write_timeout;
+
+	memset(&context->timers, 0, sizeof(timer_wheel_t));
+	context->ready_head = NULL;
+	context->ready_tail = NULL;
+	memset(&context->stats, 0, sizeof(context->stats));
+
+	pthread_mutex_init(&context->completions_lock, NULL);
+	context->completions = NULL;
+	context->completions_count = 0;
+	context->completions_capacity = 0;
+	context->timers.current = current_time_ms() / TIMER_TICK_MS;
+
 	context->connum = 0;
 	context->maxconns = config->maximum_parallel_connections;
 	context->exiting = 0;
 	return NULL;
 }
 
-xh_config xh_get_default_configs()
+static void deinit(context_t *context)
 {
-	return (xh_config) {
-		.reuse_address = 1,
-		.maximum_parallel_connections = 512,
-		.backlog = 128,
-	};
+	for(int i = 0; i < context->maxconns; i += 1)
+		if(context->pool[i].fd != -1)
+			close_connection(context, context->pool + i);
+
+	// Let the application release the state of
+	// the responses that were never completed.
+	for(int i = 0; i < context->completions_count; i += 1)
+		context->completions[i].callback(NULL, NULL, context->completions[i].userp);
+	free(context->completions);
+	pthread_mutex_destroy(&context->completions_lock);
+
+	free(context->pool);
+	pool_free(&context->buffers);
+	file_cache_free(&context->files);
+	response_cache_free(&context->responses);
+	(void) close(context->fd);
+	(void) close(context->epfd);
+	(void) close(context->wakefd);
 }
 
-const char *xhttp(const char *addr, unsigned short port, 
-				  xh_callback callback, void *userp,
-				  xh_handle *handle, const xh_config *config)
+/* Symbol: trim_buffers
+ *
+ *   Give back to the pool the buffers of a connection
+ *   that are empty and bigger than the smallest size
+ *   class, so that idle keep-alive connections hold as
+ *   little memory as possible.
+ */
+static void trim_buffers(context_t *ctx, conn_t *conn)
 {
-	xh_config dummy = xh_get_default_configs();
-	if(config == NULL)
-		config = &dummy;
+	if(buffer_count(&conn->in) == 0 && conn->in.size > ctx->buffers.base)
+		buffer_release(&ctx->buffers, &conn->in);
+
+	if(buffer_count(&conn->out) == 0 && conn->out.size > ctx->buffers.base)
+		buffer_release(&ctx->buffers, &conn->out);
+}
 
-	context_t context;
+/* Symbol: update_timer
+ *
+ *   Re-arm the timer of a connection after an event,
+ *   based on what the connection is waiting for.
+ */
+static void update_timer(context_t *ctx, conn_t *conn)
+{
+	if(conn->deferred && !wants_to_read(conn) && buffer_count(&conn->out) == 0)
+	{
+		// Waiting for the application to complete the
+		// response. If it never does, the connection is
+		// closed after [write_timeout] seconds.
+		if(conn->timer_kind != TIMER_DEFER)
+			timer_arm(ctx, conn, TIMER_DEFER, ctx->write_timeout);
+	}
 
-	const char *error = init(&context, addr, port, config);
+	else if(buffer_count(&conn->out) > 0 || response_in_progress(conn))
+		// Waiting for the client to read the response.
+		timer_arm(ctx, conn, TIMER_WRITE, ctx->write_timeout);
 
-	if(error != NULL)
-		return error;
+	else if(conn->head_received)
+		// Waiting for the rest of the body.
+		timer_arm(ctx, conn, TIMER_BODY, ctx->body_timeout);
 
-	context.callback = callback;
-	context.userp = userp;
+	else if(buffer_count(&conn->in) > 0 || conn->served == 0)
+	{
+		// Waiting for the rest of the head. The deadline
+		// is counted from the start of the request.
+		if(conn->timer_kind != TIMER_HEADER)
+			timer_arm(ctx, conn, TIMER_HEADER, ctx->header_timeout);
+	}
+	else
+	{
+		// Waiting for the next request.
+		if(conn->timer_kind != TIMER_IDLE)
+			timer_arm(ctx, conn, TIMER_IDLE, ctx->keep_alive_timeout);
+	}
+}
 
-	if(handle)
-		*handle = &context;
+/* Symbol: expire_timers
+ *
+ *   Close all connections whose deadline was reached,
+ *   processing the slots of the ticks that went by
+ *   since the last call.
+ */
+static void expire_timers(context_t *ctx)
+{
+	uint64_t now = current_time_ms() / TIMER_TICK_MS;
+	timer_wheel_t *wheel = &ctx->timers;
+
+	if(now <= wheel->current)
+		return;
+
+	// If more than a turn went by, every
+	// slot needs to be looked at only once.
+	uint64_t elapsed = now - wheel->current;
+	if(elapsed > TIMER_SLOTS)
+		elapsed = TIMER_SLOTS;
+
+	for(uint64_t i = 1; i <= elapsed && wheel->armed > 0; i += 1)
+	{
+		conn_t *conn = wheel->slots[(wheel->current + i) % TIMER_SLOTS];
+		while(conn)
+		{
+			conn_t *next = conn->timer_next;
+			if(conn->deadline <= now)
+				close_connection(ctx, conn);
+			conn = next;
+		}
+	}
+	wheel->current = now;
+}
+
+/* Symbol: next_timer_timeout
+ *
+ *   Milliseconds the event loop can wait for events
+ *   before a timer needs to be processed, or -1 if no
+ *   timers are armed. The time is counted up to the 
+ *   first non-empty slot, which may hold connections 
+ *   whose deadline is a later turn of the wheel. In
+ *   that case the loop just wakes up early.
+ */
+static int next_timer_timeout(context_t *ctx)
+{
+	timer_wheel_t *wheel = &ctx->timers;
+
+	if(wheel->armed == 0)
+		return -1;
+
+	uint64_t tick = wheel->current + 1;
+	while(wheel->slots[tick % TIMER_SLOTS] == NULL && tick < wheel->current + TIMER_SLOTS)
+		tick += 1;
+
+	uint64_t now = current_time_ms();
+	if(tick * TIMER_TICK_MS <= now)
+		return 0;
+	return tick * TIMER_TICK_MS - now;
+}
+
+/* Symbol: after_event
+ *
+ *   Send what can be sent of the connection's output,
+ *   serve the requests that were waiting for it to be
+ *   sent, and update the events the socket is monitored
+ *   for and its timer. This is done after every event
+ *   on the connection.
+ */
+static void after_event(context_t *ctx, conn_t *conn)
+{
+	bool was_in_progress = response_in_progress(conn);
+
+	if(!upload(ctx, conn))
+	{
+		close_connection(ctx, conn);
+		return;
+	}
+
+	while(was_in_progress && !response_in_progress(conn) 
+		&& !conn->close_when_uploaded)
+	{
+		// The last response was sent completely, so
+		// the requests that were received in the
+		// meantime can be served. Their responses
+		// may also complete right away. If reading
+		// stopped because the input buffer was full,
+		// the rest is still in the socket. Note that
+		// this may close the connection.
+		if(conn->input_full)
+			when_data_is_ready_to_be_read(ctx, conn);
+		else
+			serve_buffered_requests(ctx, conn);
+		if(conn->fd < 0)
+			return;
+
+		was_in_progress = response_in_progress(conn);
+
+		if(!upload(ctx, conn))
+		{
+			close_connection(ctx, conn);
+			return;
+		}
+	}
+
+	if(buffer_count(&conn->out) == 0 && !response_in_progress(conn))
+	{
+		if(conn->close_when_uploaded)
+			close_connection(ctx, conn);
+		else
+			trim_buffers(ctx, conn);
+	}
+
+	if(conn->fd < 0)
+		return;
+
+	// Only monitor writability while there's
+	// output the socket couldn't take.
+	uint32_t interest = CONN_EVENTS;
+	if(buffer_count(&conn->out) > 0 || response_in_progress(conn))
+		interest |= EPOLLOUT;
+
+	if(interest != conn->events && (interest & EPOLLOUT))
+		stat_add(&ctx->stats.write_waits, 1);
+
+	if(!rewatch(ctx, conn, interest))
+	{
+		close_connection(ctx, conn);
+		return;
+	}
+
+	// The socket may take more data or have more
+	// data to read, but since it's edge-triggered
+	// no event would be reported.
+	if(conn->throttled || conn->read_throttled || conn->serve_throttled)
+		ready_push(ctx, conn);
+
+	update_timer(ctx, conn);
+}
+
+/* Symbol: serve_ready_connections
+ *
+ *   Give a turn to each connection that was in the
+ *   ready list at the start of the call, resuming the
+ *   reads, requests and uploads that were throttled.
+ *   The ones that still have work to do are pushed
+ *   back at the end, so that they're served in turns.
+ */
+static void serve_ready_connections(context_t *ctx)
+{
+	conn_t *last = ctx->ready_tail;
+	while(ctx->ready_head != NULL)
+	{
+		conn_t *conn = ctx->ready_head;
+		ready_remove(ctx, conn);
+
+		bool is_last = (conn == last);
+		int old_connum = ctx->connum;
+
+		conn->turn_requests = 0;
+
+		// Note that these may close the connection.
+		if(conn->read_throttled)
+		{
+			conn->read_throttled = 0;
+			if(wants_to_read(conn))
+				when_data_is_ready_to_be_read(ctx, conn);
+		}
+		else if(conn->serve_throttled)
+		{
+			// If reading stopped because the input buffer
+			// was full, the rest is still in the socket.
+			if(conn->input_full && wants_to_read(conn))
+				when_data_is_ready_to_be_read(ctx, conn);
+			else
+				serve_buffered_requests(ctx, conn);
+		}
+
+		if(old_connum == ctx->connum)
+			after_event(ctx, conn);
+
+		if(is_last)
+			break;
+	}
+}
+
+/* Symbol: complete_deferred_responses
+ *
+ *   Finish serving the requests whose responses were
+ *   deferred and then completed with [xh_respond].
+ */
+static void complete_deferred_responses(context_t *ctx)
+{
+	pthread_mutex_lock(&ctx->completions_lock);
+	completion_t *list = ctx->completions;
+	int count = ctx->completions_count;
+	ctx->completions = NULL;
+	ctx->completions_count = 0;
+	ctx->completions_capacity = 0;
+	pthread_mutex_unlock(&ctx->completions_lock);
+
+	for(int i = 0; i < count; i += 1)
+	{
+		conn_t *conn = ctx->pool + list[i].slot;
+
+		// A token of a request that was already answered
+		// must not complete the one that's deferred now.
+		bool valid = conn->fd >= 0 && conn->gen == list[i].gen 
+		          && (uint32_t) conn->served == list[i].seq && conn->deferred;
+
+		if(list[i].callback == NULL)
+		{
+			// Queued by [xh_resume].
+			if(valid && conn->streaming && conn->paused)
+			{
+				conn->paused = 0;
+
+				int old_connum = ctx->connum;
+				stream_body(ctx, conn);
+				if(conn->fd >= 0 && wants_to_read(conn))
+					when_data_is_ready_to_be_read(ctx, conn);
+
+				if(old_connum == ctx->connum)
+					after_event(ctx, conn);
+			}
+			continue;
+		}
+
+		if(!valid)
+		{
+			// The connection was closed in the meantime. Let
+			// the callback release what it needs to.
+			list[i].callback(NULL, NULL, list[i].userp);
+			continue;
+		}
 
+		if(!generate_response_by_calling_the_callback(ctx, conn, list[i].callback, list[i].userp))
+			// Deferred again.
+			continue;
+
+		remove_served_request(conn);
+
+		// Nothing was read while the response was
+		// deferred, so there may be data waiting
+		// in the socket. Since it's edge-triggered,
+		// no event would be reported for it.
+		int old_connum = ctx->connum;
+		if(!conn->close_when_uploaded)
+			when_data_is_ready_to_be_read(ctx, conn);
+
+		if(old_connum == ctx->connum)
+			after_event(ctx, conn);
+	}
+	free(list);
+}
+
+static void run(context_t *context)
+{
 	struct epoll_event events[64];
 
-	while(!context.exiting)
+	while(!context->exiting)
 	{
-		int num = epoll_wait(context.epfd, events, sizeof(events)/sizeof(events[0]), 5000);
+		// Don't block if some connections are
+		// ready to be served.
+		int timeout = next_timer_timeout(context);
+		if(context->ready_head != NULL)
+			timeout = 0;
+
+		int num = epoll_wait(context->epfd, events, sizeof(events)/sizeof(events[0]), timeout);
+
+		stat_add(&context->stats.wakeups, 1);
+		if(num > 0)
+			stat_add(&context->stats.events, num);
+
+		update_date(context);
 
 		for(int i = 0; i < num; i += 1)
 		{
 			if(events[i].data.ptr == NULL)
 			{
 				// New connection.
-				accept_connection(&context);
+				accept_connection(context);
+				continue;
+			}
+
+			if(events[i].data.ptr == context)
+			{
+				// Wake-up request. Reset the counter and
+				// handle the completed deferred responses.
+				// If the server is quitting, the loop 
+				// condition will take care of the rest.
+				uint64_t dummy;
+				(void) read(context->wakefd, &dummy, sizeof(dummy));
+				complete_deferred_responses(context);
+				continue;
+			}
+
+			if(events[i].data.ptr == &context->files)
+			{
+				// Some cached files changed.
+				file_cache_handle_events(&context->files);
 				continue;
 			}
 
@@ -1714,7 +6708,7 @@ const char *xhttp(const char *addr, unsigned short port,
 			if(events[i].events & EPOLLRDHUP)
 			{
 				// Disconnection.
-				close_connection(&context, conn);
+				close_connection(context, conn);
 				continue;
 			}
 
@@ -1727,41 +6721,154 @@ const char *xhttp(const char *addr, unsigned short port,
 				events[i].events = EPOLLIN | EPOLLOUT;
 			}
 
-			int old_connum = context.connum;
+			int old_connum = context->connum;
 
-			if((events[i].events & (EPOLLIN | EPOLLPRI)) 
-				&& conn->close_when_uploaded == 0)
+			conn->turn_requests = 0;
+
+			if((events[i].events & (EPOLLIN | EPOLLPRI)) && wants_to_read(conn))
 			{
 				// Note that this may close the connection. If any logic
 			    // were to come after this function, it couldn't refer
 			    // to the connection structure.
-				when_data_is_ready_to_be_read(&context, conn);
+				when_data_is_ready_to_be_read(context, conn);
 			}
 
-			if(old_connum == context.connum)
-			{
-				// The connection wasn't closed. Try to
-				// upload the data in the output buffer.
+			if(old_connum == context->connum)
+				// The connection wasn't closed.
+				after_event(context, conn);
+		}
+
+		serve_ready_connections(context);
+		expire_timers(context);
+	}
+}
 
-				if(!upload(conn))
+static void *run_worker(void *arg)
+{
+	run(arg);
+	return NULL;
+}
 
-					close_connection(&context, conn);
+xh_config xh_get_default_configs()
+{
+	return (xh_config) {
+		.reuse_address = 1,
+		.maximum_parallel_connections = 512,
+		.backlog = 128,
+		.workers = 1,
+		.buffer_size = 512,
+		.buffer_classes = 8,
+		.buffer_pool_budget = 4 << 20,
+		.accept_budget = 64,
+		.max_buffered_body = 1 << 20,
+		.stream_bodies = 0,
+		.max_body_chunks = 65536,
+		.file_cache_size = 256,
+		.response_cache_size = 16 << 20,
+		.file_cache_ttl = 0,
+		.sendfile_budget = 1 << 20,
+		.read_budget = 256 << 10,
+		.request_budget = 32,
+		.defer_accept = 0,
+		.max_head_size = 32 << 10,
+		.keep_alive_max_requests = 1000,
+		.keep_alive_timeout = 5,
+		.keep_alive_threshold = 80,
+		.header_timeout = 10,
+		.body_timeout = 30,
+		.write_timeout = 30,
+	};
+}
 
-				else
-					if(conn->out.used == 0 && conn->close_when_uploaded)
-						close_connection(&context, conn);
-			}
+const char *xhttp(const char *addr, unsigned short port, 
+				  xh_callback callback, void *userp,
+				  xh_handle *handle, const xh_config *config)
+{
+	xh_config dummy = xh_get_default_configs();
+	if(config == NULL)
+		config = &dummy;
+
+	select_scanner();
+
+	unsigned int count = config->workers;
+	if(count == XH_WORKERS_PER_CPU)
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		count = (n > 0) ? n : 1;
+	}
+	else if(count == 0)
+		count = 1;
+
+	server_t server;
+	server.count = 0;
+	server.workers = malloc(count * sizeof(context_t));
+
+	if(server.workers == NULL)
+		return "Failed to allocate workers";
+
+	for(unsigned int i = 0; i < count; i += 1)
+	{
+		context_t *context = server.workers + i;
+
+		const char *error = init(context, addr, port, config, count > 1);
+
+		if(error != NULL)
+		{
+			for(unsigned int j = 0; j < i; j += 1)
+				deinit(server.workers + j);
+			free(server.workers);
+			return error;
+		}
+
+		context->callback = callback;
+		context->userp = userp;
+		context->worker = i;
+		server.count += 1;
+	}
+
+	if(handle)
+		*handle = &server;
+
+	// Start all workers other than the first one, which
+	// runs on this thread. Signals are blocked while the
+	// threads are created so that they inherit a mask 
+	// that blocks everything, which makes the user's
+	// signal handlers always run on this thread.
+	unsigned int started = 1;
+	{
+		sigset_t all, old;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+
+		while(started < count)
+		{
+			context_t *context = server.workers + started;
+			if(pthread_create(&context->thread, NULL, run_worker, context))
+				break;
+			started += 1;
 		}
+
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
 	}
 
-	for(unsigned int i = 0; i < config->maximum_parallel_connections; i += 1)
-		if(context.pool[i].fd != -1)
-			close_connection(&context, context.pool + i);
+	const char *error = NULL;
 
-	free(context.pool);
-	(void) close(context.fd);
-	(void) close(context.epfd);
-	return NULL;
+	if(started < count)
+	{
+		error = "Failed to start worker thread";
+		xh_quit(&server);
+	}
+	else
+		run(server.workers);
+
+	for(unsigned int i = 1; i < started; i += 1)
+		pthread_join(server.workers[i].thread, NULL);
+
+	for(unsigned int i = 0; i < count; i += 1)
+		deinit(server.workers + i);
+
+	free(server.workers);
+	return error;
 }
 
 int xh_urlcmp(const char *URL, const char *fmt, ...)
@@ -1,6 +1,8 @@
 #ifndef XHTTP_H
 #define XHTTP_H
 
+#include <stddef.h>
+
 typedef void *xh_handle;
 
 typedef struct {
@@ -28,6 +30,46 @@ typedef enum {
 	XH_PATCH   = 256,
 } xh_method;
 
+// Well-known headers, which can be looked up in
+// constant time with [xh_header_get_id].
+typedef enum {
+	XH_HDR_ACCEPT,
+	XH_HDR_ACCEPT_ENCODING,
+	XH_HDR_ACCEPT_LANGUAGE,
+	XH_HDR_AUTHORIZATION,
+	XH_HDR_CACHE_CONTROL,
+	XH_HDR_CONNECTION,
+	XH_HDR_CONTENT_ENCODING,
+	XH_HDR_CONTENT_LENGTH,
+	XH_HDR_CONTENT_RANGE,
+	XH_HDR_CONTENT_TYPE,
+	XH_HDR_COOKIE,
+	XH_HDR_DATE,
+	XH_HDR_ETAG,
+	XH_HDR_EXPECT,
+	XH_HDR_HOST,
+	XH_HDR_IF_MATCH,
+	XH_HDR_IF_MODIFIED_SINCE,
+	XH_HDR_IF_NONE_MATCH,
+	XH_HDR_IF_RANGE,
+	XH_HDR_IF_UNMODIFIED_SINCE,
+	XH_HDR_KEEP_ALIVE,
+	XH_HDR_LAST_MODIFIED,
+	XH_HDR_LOCATION,
+	XH_HDR_ORIGIN,
+	XH_HDR_RANGE,
+	XH_HDR_REFERER,
+	XH_HDR_SERVER,
+	XH_HDR_SET_COOKIE,
+	XH_HDR_TRANSFER_ENCODING,
+	XH_HDR_UPGRADE,
+	XH_HDR_USER_AGENT,
+	XH_HDR_COUNT,
+} xh_header_id;
+
+// Maximum number of captures in a route pattern.
+#define XH_MAX_CAPTURES 8
+
 typedef struct {
 	xh_method method_id;
 	xh_string method;
@@ -37,6 +79,27 @@ typedef struct {
 	unsigned int version_major;
 	xh_table headers;
 	xh_string body;
+
+	// Index of the worker (in the range
+	// [0, workers)) whose thread is running
+	// the callback. It can be used to keep
+	// per-thread state without locking.
+	unsigned int worker;
+
+	// Set when the body is too big to be buffered
+	// and [xh_config.stream_bodies] is enabled. The
+	// callback is then called before the body is
+	// received, with an empty [body], and can read
+	// it with [xh_stream].
+	_Bool body_streamed;
+
+	// If the request matched a route of the
+	// [xh_config.router], the parts of the URL
+	// that matched the ":d" and ":s" segments 
+	// of its pattern, in order. They point into
+	// the URL, so they aren't zero-terminated.
+	xh_string captures[XH_MAX_CAPTURES];
+	int       capture_count;
 } xh_request;
 
 typedef struct {
@@ -46,28 +109,237 @@ typedef struct {
 	xh_string   body;
 	const char *file;
 
+	// If set, the memory pointed by [body.str] is
+	// handed over to the library, which sends it
+	// without copying it and then calls [release]
+	// on it (for example, [free]). Otherwise [body]
+	// is only borrowed until the callback returns.
+	// It's called exactly once if [body.str] isn't
+	// NULL, even when the body isn't sent (because
+	// of [file], [producer] or an error), and never
+	// if it's NULL.
+	void (*release)(void*);
+
+	// If set, the body is generated while it's sent
+	// instead of being provided up front ([body] and
+	// [file] are ignored). Whenever the connection 
+	// can take more data, [producer] is called to
+	// write up to [max] bytes of the body into [dst].
+	// It returns the number of bytes written, 0 when
+	// the body is over or -1 to abort the response 
+	// (closing the connection). Once the body is over
+	// or the connection is closed, it's called one
+	// last time with a NULL [dst] so that [producer_userp]
+	// can be released. The body is sent with chunked 
+	// encoding to HTTP/1.1 clients and delimited by
+	// closing the connection for older ones.
+	int  (*producer)(char *dst, int max, void *producer_userp);
+	void  *producer_userp;
+
+	// If not 0, the response is stored in the worker's
+	// response cache for [cache_ttl] seconds. Until
+	// then, the GET and HEAD requests for the same Host
+	// and URL (parameters included) are answered from
+	// there without calling the callback. If [cache_vary]
+	// is set, it's a comma-separated list of request
+	// headers (like "Accept-Encoding, Cookie") that
+	// must also have the same values. Responses with
+	// a [file] or [producer] body aren't cached. A Date
+	// header isn't stored, the current date is sent
+	// with each cached response.
+	unsigned int cache_ttl;
+	const char  *cache_vary;
+
 	_Bool close;
 } xh_response;
 
+// Value of [xh_config.workers] that starts one
+// worker per online CPU.
+#define XH_WORKERS_PER_CPU ((unsigned int) -1)
+
+typedef struct xh_router xh_router;
+
 typedef struct {
 	_Bool        reuse_address;
 	unsigned int maximum_parallel_connections;
 	unsigned int backlog;
+
+	// Number of event loops to run in parallel,
+	// each on its own thread with its own listening
+	// socket (bound with SO_REUSEPORT) and its own
+	// pool of [maximum_parallel_connections]
+	// connections. 0 is the same as 1, so that a
+	// zero-initialized config stays single-threaded.
+	// Use [XH_WORKERS_PER_CPU] to start one worker
+	// per online CPU.
+	unsigned int workers;
+
+	// Connection I/O buffers are borrowed from a
+	// per-worker pool. The pool holds buffers of
+	// [buffer_classes] sizes, the smallest being 
+	// [buffer_size] bytes and each one double the
+	// previous. Up to [buffer_pool_budget] bytes
+	// of unused buffers are kept by each worker
+	// for reuse. Idle connections are trimmed
+	// back to the smallest size.
+	unsigned int buffer_size;
+	unsigned int buffer_classes;
+	size_t       buffer_pool_budget;
+
+	// Maximum number of connections accepted each
+	// time the listener is reported as ready, so that
+	// a burst of connections doesn't starve the ones
+	// already established.
+	unsigned int accept_budget;
+
+	// If not 0, connections are only reported once
+	// the client sent some data or after this many
+	// seconds (TCP_DEFER_ACCEPT).
+	unsigned int defer_accept;
+
+	// Requests whose head (request line and headers)
+	// is longer than [max_head_size] bytes are
+	// rejected with a 431 status and the connection
+	// is closed.
+	unsigned int max_head_size;
+
+	// Requests with bodies bigger than [max_buffered_body]
+	// bytes are rejected with a 413 status, unless 
+	// [stream_bodies] is set. In that case the body is
+	// passed to the callback in chunks of at most
+	// [max_buffered_body] bytes as it arrives. The
+	// same goes for bodies sent with chunked encoding
+	// once their decoded size goes over the limit. 
+	// They're refused if they're split in more than
+	// [max_body_chunks] chunks (0 means no limit).
+	unsigned int max_buffered_body;
+	_Bool        stream_bodies;
+	unsigned int max_body_chunks;
+
+	// Each worker keeps up to [file_cache_size] of 
+	// the files it served through [xh_response.file] 
+	// open (0 disables the cache). Cached files are
+	// reopened when inotify reports that they changed
+	// and, if [file_cache_ttl] isn't 0, after that 
+	// many seconds. If inotify isn't available, 
+	// they're reopened every second by default.
+	unsigned int file_cache_size;
+	unsigned int file_cache_ttl;
+
+	// Maximum number of bytes of responses each 
+	// worker keeps in its response cache (0 disables
+	// it). See [xh_response.cache_ttl].
+	size_t response_cache_size;
+
+	// Maximum number of bytes of response bodies
+	// sent to a connection before serving the others,
+	// so that a big transfer can't starve them (0 
+	// means no limit). It applies to bodies sent from
+	// files, from memory and by producers alike.
+	unsigned long long sendfile_budget;
+
+	// Maximum number of bytes read from a connection
+	// and of requests it's served each time it's 
+	// given its turn. When a connection runs out of
+	// budget, the other ones are served before it
+	// goes on (0 means no limit).
+	unsigned int read_budget;
+	unsigned int request_budget;
+
+	// Keep-alive policy. HTTP/1.1 connections are
+	// persistent unless the client asks otherwise,
+	// HTTP/1.0 ones only if the client asks for it.
+	// A connection is closed after serving 
+	// [keep_alive_max_requests] requests (0 means
+	// no limit) or after staying idle for
+	// [keep_alive_timeout] seconds (0 means never).
+	// When the percentage of the connection pool
+	// in use goes over [keep_alive_threshold], 
+	// connections are closed after each response.
+	unsigned int keep_alive_max_requests;
+	unsigned int keep_alive_timeout;
+	unsigned int keep_alive_threshold;
+
+	// Seconds a client is given to send the head
+	// of a request, to make progress sending its
+	// body and to make progress reading a response
+	// before the connection is closed. 0 means no
+	// timeout. A deferred response must also be
+	// completed within [write_timeout] seconds.
+	unsigned int header_timeout;
+	unsigned int body_timeout;
+	unsigned int write_timeout;
+
+	// If set, each request is matched against the
+	// routes registered with [xh_route] and, if one
+	// matches, its callback is called instead of 
+	// the one given to [xhttp]. The router can't be
+	// modified or freed while the server runs.
+	xh_router *router;
 } xh_config;
 
 typedef void (*xh_callback)(xh_request*, xh_response*, void*);
 
+// Tells whether memory given to the library is
+// copied or used as it is. See [xh_header_add_string].
+typedef enum {
+	XH_COPY,
+	XH_BORROW,
+} xh_ownership;
+
+// Receives the chunks of a streamed request body. 
+// [last] is set for the final chunk. Returning 0
+// stops the delivery until [xh_resume] is called.
+typedef _Bool (*xh_body_callback)(xh_string chunk, _Bool last, void *userp);
+
+// Identifies a deferred response. See [xh_defer].
+typedef struct {
+	unsigned int worker;
+	unsigned int slot;
+	unsigned int gen;
+	unsigned int seq;
+} xh_token;
+
+typedef struct {
+	unsigned long long wakeups;     // Returns from waiting for events.
+	unsigned long long events;      // Events reported by those waits.
+	unsigned long long requests;    // Responses generated.
+	unsigned long long connections; // Connections accepted.
+	unsigned long long write_waits; // Times a full socket buffer made the
+	                                // server wait for writability.
+	unsigned long long cache_hits;      // Responses served from the response cache.
+	unsigned long long cache_misses;    // Lookups in the response cache that failed.
+	unsigned long long cache_evictions; // Cached responses evicted to make room.
+} xh_stats;
+
 const char *xhttp(const char *addr, unsigned short port, 
 	              xh_callback callback, void *userp, 
 	              xh_handle *handle, const xh_config *config);
 void        xh_quit(xh_handle handle);
+xh_stats    xh_get_stats(xh_handle handle);
 xh_config   xh_get_default_configs();
 
 void        xh_header_add(xh_response *res, const char *name, const char *valfmt, ...);
+void        xh_header_add_string(xh_response *res, xh_string name, xh_string value, 
+                                 xh_ownership ownership);
 void        xh_header_rem(xh_response *res, const char *name);
 const char *xh_header_get(void *req_or_res, const char *name);
+const char *xh_header_get_id(void *req_or_res, xh_header_id id);
 _Bool       xh_header_cmp(const char *a, const char *b);
 
+void       *xh_alloc(xh_response *res, size_t size);
+
+xh_token    xh_defer(xh_response *res);
+_Bool       xh_respond(xh_handle handle, xh_token token, 
+                       xh_callback callback, void *userp);
+xh_token    xh_stream(xh_response *res, xh_body_callback callback, void *userp);
+_Bool       xh_resume(xh_handle handle, xh_token token);
+
+xh_router  *xh_router_create(void);
+void        xh_router_free(xh_router *router);
+const char *xh_route(xh_router *router, int methods, const char *pattern, 
+                     xh_callback callback, void *userp);
+
 int  xh_urlcmp(const char *URL, const char *fmt, ...);
 int xh_vurlcmp(const char *URL, const char *fmt, va_list va);
 